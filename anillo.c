@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "anillo.h"
+
+//duerme mientras *contador valga visto, hasta que la otra parte lo despierte
+//o pasen ESPERA_CIERRE_MS. la region es compartida entre procesos, asi que
+//el futex no es FUTEX_PRIVATE
+static void dormir(uint32_t* contador, uint32_t visto, uint32_t* durmiendo) {
+  __atomic_store_n(durmiendo, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(contador, __ATOMIC_SEQ_CST) == visto) { //no avanzo mientras nos marcabamos
+    struct timespec ts = {.tv_sec = ESPERA_CIERRE_MS / 1000, .tv_nsec = (ESPERA_CIERRE_MS % 1000) * 1000000L};
+    syscall(SYS_futex, contador, FUTEX_WAIT, visto, &ts, NULL, 0);
+  }
+  __atomic_store_n(durmiendo, 0, __ATOMIC_RELAXED);
+}
+
+//despierta a la otra parte si duerme esperando que cambie *contador.
+//*contador se escribio con __ATOMIC_SEQ_CST: junto con esta lectura y las de
+//dormir, o la otra parte ve el avance o nosotros vemos que duerme
+static void despertar(uint32_t* contador, uint32_t* durmiendo) {
+  if (__atomic_load_n(durmiendo, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, contador, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+//pausa dentro del giro, le avisa al procesador que estamos esperando
+static inline void pausa() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+//procesadores en linea, se consulta una sola vez
+static int cantidad_procesadores() {
+  static int procesadores = 0;
+  int n = __atomic_load_n(&procesadores, __ATOMIC_RELAXED);
+  if (n == 0) { //si dos threads llegan a la vez, los dos guardan lo mismo
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    __atomic_store_n(&procesadores, n, __ATOMIC_RELAXED);
+  }
+  return n;
+}
+
+//espera a que la otra parte avance *contador, que valia visto.
+//primero gira (si hay mas de un procesador), despues cede el procesador
+//y por ultimo duerme en el futex.
+//cada vez que se despierta vigila el socket fd (si no es -1) para detectar
+//que la otra parte termino sin marcar la region como cerrada.
+//retorna -1 si la conexion se cerro.
+static int esperar(int* vueltas, int* cerrado, int fd, uint32_t* contador, uint32_t visto, uint32_t* durmiendo) {
+  
+  if (__atomic_load_n(cerrado, __ATOMIC_ACQUIRE)) return -1;
+  
+  *vueltas += 1;
+  //con un solo procesador girar solo le quita tiempo a la otra parte
+  if (*vueltas < VUELTAS_ESPERA && cantidad_procesadores() > 1) {
+    pausa();
+  } else if (*vueltas < VUELTAS_CEDER) {
+    sched_yield();
+  } else {
+    if (fd >= 0) {
+      struct pollfd p = {.fd = fd, .events = POLLRDHUP};
+      if (poll(&p, 1, 0) > 0 && (p.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+        __atomic_store_n(cerrado, 1, __ATOMIC_RELEASE);
+        return -1;
+      }
+    }
+    dormir(contador, visto, durmiendo);
+  }
+  return 0;
+}
+
+//escribe n bytes en el anillo, esperando si no hay lugar.
+//retorna 0, o -1 si la conexion se cerro.
+int anillo_escribir(Anillo* a, const void* buf, size_t n, int* cerrado, int fd) {
+  
+  const char* origen = buf;
+  int vueltas = 0;
+  
+  while (n > 0) {
+    uint32_t escrito = a->escrito; //solo lo modifica este lado
+    uint32_t leido = __atomic_load_n(&a->leido, __ATOMIC_ACQUIRE);
+    size_t libre = TAM_ANILLO - (escrito - leido);
+    
+    if (libre == 0) {
+      if (esperar(&vueltas, cerrado, fd, &a->leido, leido, &a->escritorDurmiendo) < 0) return -1;
+      continue;
+    }
+    vueltas = 0;
+    
+    size_t pos = escrito & (TAM_ANILLO - 1);
+    size_t cant = n < libre ? n : libre;
+    if (cant > TAM_ANILLO - pos) cant = TAM_ANILLO - pos; //hasta el final del buffer
+    
+    memcpy(a->datos + pos, origen, cant);
+    __atomic_store_n(&a->escrito, escrito + cant, __ATOMIC_SEQ_CST); //ver despertar
+    despertar(&a->escrito, &a->lectorDurmiendo);
+    origen += cant;
+    n -= cant;
+  }
+  return 0;
+}
+
+//lee n bytes del anillo, esperando hasta que esten disponibles.
+//retorna 0, o -1 si la conexion se cerro.
+int anillo_leer(Anillo* a, void* buf, size_t n, int* cerrado, int fd) {
+  
+  char* destino = buf;
+  int vueltas = 0;
+  
+  while (n > 0) {
+    uint32_t leido = a->leido; //solo lo modifica este lado
+    uint32_t escrito = __atomic_load_n(&a->escrito, __ATOMIC_ACQUIRE);
+    size_t disponible = escrito - leido;
+    
+    if (disponible == 0) {
+      if (esperar(&vueltas, cerrado, fd, &a->escrito, escrito, &a->lectorDurmiendo) < 0) return -1;
+      continue;
+    }
+    vueltas = 0;
+    
+    size_t pos = leido & (TAM_ANILLO - 1);
+    size_t cant = n < disponible ? n : disponible;
+    if (cant > TAM_ANILLO - pos) cant = TAM_ANILLO - pos;
+    
+    memcpy(destino, a->datos + pos, cant);
+    __atomic_store_n(&a->leido, leido + cant, __ATOMIC_SEQ_CST); //ver despertar
+    despertar(&a->leido, &a->escritorDurmiendo);
+    destino += cant;
+    n -= cant;
+  }
+  return 0;
+}
+
+//bytes que hay para leer en el anillo
+size_t anillo_disponible(Anillo* a) {
+  return __atomic_load_n(&a->escrito, __ATOMIC_ACQUIRE) - a->leido;
+}
+
+//descarta todo lo que hay para leer en el anillo
+void anillo_descartar(Anillo* a) {
+  __atomic_store_n(&a->leido, __atomic_load_n(&a->escrito, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+  despertar(&a->leido, &a->escritorDurmiendo);
+}
+
+//despierta a quien duerma en el anillo, para que vea que la region se cerro
+void anillo_despertar(Anillo* a) {
+  syscall(SYS_futex, &a->escrito, FUTEX_WAKE, 1, NULL, NULL, 0);
+  syscall(SYS_futex, &a->leido, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
@@ -0,0 +1,51 @@
+#ifndef __ANILLO_H__
+#define __ANILLO_H__
+#include <stdint.h>
+#include <stddef.h>
+
+//transporte de memoria compartida para clientes en el mismo host.
+//el cliente crea la region (memfd), se la pasa al servidor por el socket unix
+//(SCM_RIGHTS) y desde ahi los pedidos y respuestas viajan por dos anillos,
+//con el mismo formato que por el socket.
+
+#define TAM_ANILLO (1 << 20) //bytes de cada anillo (potencia de 2)
+
+//espera activa antes de ceder el procesador y despues dormir (futex)
+#define VUELTAS_ESPERA 2000
+#define VUELTAS_CEDER 2100
+#define ESPERA_CIERRE_MS 200 //cada cuanto se despierta el que duerme para ver si se cerro el socket
+
+//anillo de un solo productor y un solo consumidor.
+//escrito y leido son contadores de bytes totales (mod 2^32),
+//separados en lineas de cache distintas.
+//el que espera que el otro avance duerme en un futex sobre su contador,
+//y lo marca en lectorDurmiendo/escritorDurmiendo para que el otro lo despierte.
+typedef struct _anillo {
+  uint32_t escrito;
+  uint32_t lectorDurmiendo; //el lector espera que cambie escrito
+  char relleno1[56];
+  uint32_t leido;
+  uint32_t escritorDurmiendo; //el escritor espera que cambie leido
+  char relleno2[56];
+  char datos[TAM_ANILLO];
+} Anillo;
+
+//region compartida entre el cliente y el servidor
+typedef struct _regionCompartida {
+  Anillo pedidos; //cliente -> servidor
+  Anillo respuestas; //servidor -> cliente
+  int cerrado; //alguna de las partes cerro la conexion
+} RegionCompartida;
+
+//FUNCIONES ANILLO
+int anillo_escribir(Anillo* a, const void* buf, size_t n, int* cerrado, int fd);
+
+int anillo_leer(Anillo* a, void* buf, size_t n, int* cerrado, int fd);
+
+size_t anillo_disponible(Anillo* a);
+
+void anillo_descartar(Anillo* a);
+
+void anillo_despertar(Anillo* a);
+
+#endif
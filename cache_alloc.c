@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cache_alloc.h"
+#include "pool.h"
+
+//cache del thread actual
+static __thread CacheLocal* local = NULL;
+
+//bytes tomados del pool o de malloc y todavia no devueltos: incluye los
+//bloques libres que guardan las caches, los lotes y las pilas remotos.
+//cada thread acumula su diferencia y la vuelca cada UMBRAL_CONTADOR bytes,
+//por lo que el valor puede atrasarse hasta UMBRAL_CONTADOR por thread
+static long memoriaUsada = 0;
+static __thread long deltaLocal = 0;
+
+//registro de todas las caches creadas, para poder liberar
+//los bloques devueltos que sus dueños todavia no recogieron
+static CacheLocal* registro = NULL;
+static pthread_mutex_t lockRegistro = PTHREAD_MUTEX_INITIALIZER;
+
+//clave para liberar la cache cuando termina el thread
+static pthread_key_t claveCache;
+static pthread_once_t claveCacheOnce = PTHREAD_ONCE_INIT;
+
+//cabecera de un bloque
+static Cabecera* cabecera(void* dato) {
+  return (Cabecera*)dato - 1;
+}
+
+//suma d bytes al contador de memoria en uso
+static void contar(long d) {
+  deltaLocal += d;
+  if (deltaLocal > UMBRAL_CONTADOR || deltaLocal < -UMBRAL_CONTADOR) {
+    __atomic_add_fetch(&memoriaUsada, deltaLocal, __ATOMIC_RELAXED);
+    deltaLocal = 0;
+  }
+}
+
+//memoria tomada por los items, buffers y caches, en bytes (aproximada)
+size_t memoria_en_uso() {
+  long m = __atomic_load_n(&memoriaUsada, __ATOMIC_RELAXED);
+  return m > 0 ? (size_t)m : 0;
+}
+
+//clase de tamaño que corresponde a tam (mas la cabecera), -1 si es demasiado grande
+static int clase_de(size_t tam) {
+  for (int c = 0; c < NCLASES; c++) {
+    if (tam + sizeof(Cabecera) <= ((size_t)TAM_MIN << c)) return c;
+  }
+  return -1;
+}
+
+//orden del pool de los bloques de la clase (los pedidos grandes usan orden_de)
+static int orden_clase(int clase) {
+  return orden_de(TAM_MIN) + clase;
+}
+
+//devuelve el bloque a donde salio: al pool o al sistema
+static void devolver(Cabecera* h) {
+  contar(h->clase >= 0 ? -((long)TAM_MIN << h->clase) : -(long)h->tam);
+  if (h->nodo >= 0) {
+    int orden = h->clase >= 0 ? orden_clase(h->clase) : orden_de(sizeof(Cabecera) + h->tam);
+    devolver_pool(h, orden, h->nodo);
+  } else {
+    free(h);
+  }
+}
+
+//devuelve una cadena de bloques
+static void liberar_cadena(Bloque* b) {
+  while (b != NULL) {
+    Bloque* sig = b->sig;
+    devolver(cabecera(b));
+    b = sig;
+  }
+}
+
+//guarda un bloque propio en la lista de su clase, o lo libera
+//si la lista ya tiene BYTES_LOCAL_CLASE bytes
+static void guardar_local(CacheLocal* cl, Bloque* b) {
+  int c = cabecera(b)->clase;
+  if ((size_t)cl->cantidad[c] * ((size_t)TAM_MIN << c) >= BYTES_LOCAL_CLASE) {
+    devolver(cabecera(b));
+    return;
+  }
+  b->sig = cl->libres[c];
+  cl->libres[c] = b;
+  cl->cantidad[c] += 1;
+}
+
+//toma los bloques que otros threads nos devolvieron
+static void recoger_remotos(CacheLocal* cl) {
+  Bloque* b = __atomic_exchange_n(&cl->remotos, NULL, __ATOMIC_ACQUIRE);
+  while (b != NULL) {
+    Bloque* sig = b->sig;
+    guardar_local(cl, b);
+    b = sig;
+  }
+}
+
+//devuelve el lote a su dueño, apilando la cadena entera con un solo CAS
+static void enviar_lote(LoteRemoto* lote) {
+  
+  if (lote->cantidad == 0) return;
+  CacheLocal* d = lote->duenio;
+  
+  Bloque* viejo = __atomic_load_n(&d->remotos, __ATOMIC_ACQUIRE);
+  do {
+    lote->ultimo->sig = viejo;
+  } while (!__atomic_compare_exchange_n(&d->remotos, &viejo, lote->primero, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  
+  //si el dueño termino mientras tanto nadie va a recoger la pila
+  if (__atomic_load_n(&d->muerto, __ATOMIC_ACQUIRE))
+    liberar_cadena(__atomic_exchange_n(&d->remotos, NULL, __ATOMIC_ACQUIRE));
+  
+  lote->duenio = NULL;
+  lote->primero = NULL;
+  lote->ultimo = NULL;
+  lote->cantidad = 0;
+}
+
+//agrega un bloque de otro thread al lote correspondiente
+static void encolar_remoto(CacheLocal* cl, CacheLocal* duenio, Bloque* b) {
+  
+  if (__atomic_load_n(&duenio->muerto, __ATOMIC_ACQUIRE)) {
+    devolver(cabecera(b));
+    return;
+  }
+  
+  LoteRemoto* lote = NULL;
+  for (int i = 0; i < SLOTS_REMOTOS && lote == NULL; i++) {
+    if (cl->lotes[i].duenio == duenio) lote = &cl->lotes[i];
+  }
+  for (int i = 0; i < SLOTS_REMOTOS && lote == NULL; i++) {
+    if (cl->lotes[i].duenio == NULL) lote = &cl->lotes[i];
+  }
+  if (lote == NULL) { //no hay slots libres, enviamos el primero
+    lote = &cl->lotes[0];
+    enviar_lote(lote);
+  }
+  
+  lote->duenio = duenio;
+  b->sig = lote->primero;
+  lote->primero = b;
+  if (lote->ultimo == NULL) lote->ultimo = b;
+  lote->cantidad += 1;
+  
+  if (lote->cantidad >= LOTE_REMOTO) enviar_lote(lote);
+}
+
+//se llama cuando termina un thread que tenia cache.
+//la estructura no se libera porque quedan bloques que apuntan a ella
+static void destruir_cache(void* arg) {
+  CacheLocal* cl = (CacheLocal*)arg;
+  local = cl;
+  vaciar_cache_local();
+  __atomic_store_n(&cl->muerto, 1, __ATOMIC_RELEASE);
+  liberar_cadena(__atomic_exchange_n(&cl->remotos, NULL, __ATOMIC_ACQUIRE));
+  local = NULL;
+  
+  //volcamos lo que el thread no llego a sumar al contador
+  __atomic_add_fetch(&memoriaUsada, deltaLocal, __ATOMIC_RELAXED);
+  deltaLocal = 0;
+}
+
+static void crear_clave_cache() {
+  pthread_key_create(&claveCache, destruir_cache);
+}
+
+//cache del thread actual, la crea si no existe
+static CacheLocal* cache_local() {
+  if (local == NULL) {
+    pthread_once(&claveCacheOnce, crear_clave_cache);
+    local = calloc(1, sizeof(CacheLocal));
+    if (local != NULL) {
+      pthread_setspecific(claveCache, local);
+      pthread_mutex_lock(&lockRegistro);
+      local->sigRegistro = registro;
+      registro = local;
+      pthread_mutex_unlock(&lockRegistro);
+    }
+  }
+  return local;
+}
+
+//reserva tam bytes.
+//primero intenta con la lista de la clase en la cache del thread,
+//despues con los bloques devueltos por otros threads y por ultimo con
+//el pool (si se reservo) o malloc.
+//con el pool, todos los bloques salen de el: si no tiene, no se usa malloc
+//(el margen fuera del pool es para stacks y la tablahash).
+//retorna NULL si no hay memoria (safe_malloc se encarga del desalojo).
+void* reservar(size_t tam) {
+  
+  int c = clase_de(tam);
+  CacheLocal* cl = (c < 0) ? NULL : cache_local();
+  
+  if (cl == NULL) { //pedido grande, va directo al pool o a malloc
+    int nodo = -1;
+    Cabecera* h = pool_activo() ? tomar_pool(orden_de(sizeof(Cabecera) + tam), &nodo) : malloc(sizeof(Cabecera) + tam);
+    if (h == NULL) return NULL;
+    h->tam = tam;
+    h->clase = -1;
+    h->nodo = nodo;
+    contar(tam);
+    return h + 1;
+  }
+  
+  if (cl->libres[c] == NULL) recoger_remotos(cl);
+  
+  Bloque* b = cl->libres[c];
+  if (b != NULL) {
+    cl->libres[c] = b->sig;
+    cl->cantidad[c] -= 1;
+    return b; //ya estaba contado
+  }
+  
+  //si se reservo el pool, los bloques salen de el
+  int nodo = -1;
+  Cabecera* h = pool_activo() ? tomar_pool(orden_clase(c), &nodo) : malloc((size_t)TAM_MIN << c);
+  if (h == NULL) return NULL;
+  h->duenio = cl;
+  h->clase = c;
+  h->nodo = nodo;
+  contar((long)TAM_MIN << c);
+  return h + 1;
+}
+
+//reserva un buffer temporal (respuestas, pedidos reenviados): como reservar,
+//pero si el pool no tiene lugar usa malloc, dentro del margen fuera del pool.
+//se libera con liberar()
+void* reservar_temporal(size_t tam) {
+  
+  void* dato = reservar(tam);
+  if (dato != NULL || !pool_activo()) return dato;
+  
+  Cabecera* h = malloc(sizeof(Cabecera) + tam);
+  if (h == NULL) return NULL;
+  h->tam = tam;
+  h->clase = -1;
+  h->nodo = -1;
+  contar(tam);
+  return h + 1;
+}
+
+//libera un dato obtenido con reservar.
+//si el bloque es de este thread vuelve a su lista,
+//si es de otro se le devuelve en un lote.
+void liberar(void* dato) {
+  
+  if (dato == NULL) return;
+  
+  Cabecera* h = cabecera(dato);
+  if (h->clase < 0) {
+    devolver(h);
+    return;
+  }
+  
+  //el bloque sigue contado mientras lo guarde alguna cache
+  CacheLocal* cl = cache_local();
+  if (cl == NULL) { //no hay memoria ni para la cache, lo liberamos directamente
+    devolver(h);
+  } else if (h->duenio == cl) {
+    guardar_local(cl, (Bloque*)dato);
+  } else {
+    encolar_remoto(cl, h->duenio, (Bloque*)dato);
+  }
+}
+
+//devuelve al sistema (o al pool) toda la memoria libre de la cache del thread,
+//junto con los bloques que esperan en la pila remotos de cualquier
+//thread (free puede llamarse desde cualquiera). se usa cuando malloc falla,
+//ya que lo que libera el desalojo suele pertenecer a otros threads.
+void vaciar_cache_local() {
+  
+  CacheLocal* cl = local;
+  if (cl == NULL) return;
+  
+  for (int i = 0; i < SLOTS_REMOTOS; i++) {
+    enviar_lote(&cl->lotes[i]);
+  }
+  for (int c = 0; c < NCLASES; c++) {
+    liberar_cadena(cl->libres[c]);
+    cl->libres[c] = NULL;
+    cl->cantidad[c] = 0;
+  }
+  
+  pthread_mutex_lock(&lockRegistro);
+  CacheLocal* primera = registro;
+  pthread_mutex_unlock(&lockRegistro);
+  
+  //el registro solo crece por el principio, se puede recorrer sin el lock
+  for (CacheLocal* c = primera; c != NULL; c = c->sigRegistro) {
+    liberar_cadena(__atomic_exchange_n(&c->remotos, NULL, __ATOMIC_ACQUIRE));
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef __CACHE_ALLOC_H__
+#define __CACHE_ALLOC_H__
+#include <stddef.h>
+
+//clases de tamaño: bloques de TAM_MIN << clase bytes contando la cabecera,
+//hasta TAM_MIN << (NCLASES - 1) (2MB). al ser potencias de 2, el pool
+//(ver pool.h) los puede juntar con su buddy.
+//los pedidos mas grandes van directo al pool o a malloc
+#define NCLASES 17
+#define TAM_MIN 32
+
+//limites de las caches de cada thread
+#define BYTES_LOCAL_CLASE (256 * 1024) //bytes libres que se guardan por clase
+#define LOTE_REMOTO 32 //bloques de otro thread que se juntan antes de devolverlos
+#define SLOTS_REMOTOS 8 //threads distintos a los que se les arma un lote a la vez
+#define UMBRAL_CONTADOR (64 * 1024) //bytes que acumula cada thread antes de actualizar el contador global
+
+//bloque libre, se guarda en el mismo espacio que usa el dato
+typedef struct _bloque {
+  struct _bloque* sig;
+} Bloque;
+
+//lote de bloques liberados por este thread que pertenecen a otro
+typedef struct _loteRemoto {
+  struct _cacheLocal* duenio;
+  Bloque* primero;
+  Bloque* ultimo;
+  int cantidad;
+} LoteRemoto;
+
+//cache de cada thread
+//los bloques pertenecen al thread que los reservo. si otro thread los libera
+//los junta en un lote y se los devuelve de a LOTE_REMOTO, por la pila remotos.
+typedef struct _cacheLocal {
+  Bloque* libres[NCLASES];
+  int cantidad[NCLASES];
+  Bloque* remotos; //pila lock-free de bloques devueltos por otros threads
+  LoteRemoto lotes[SLOTS_REMOTOS];
+  int muerto; //el thread termino, los bloques que se le devuelvan se liberan
+  struct _cacheLocal* sigRegistro; //siguiente cache creada (registro global)
+} CacheLocal;
+
+//cabecera de cada bloque (16 bytes, mantiene la alineacion de malloc)
+typedef struct _cabecera {
+  union {
+    CacheLocal* duenio; //thread que reservo el bloque
+    size_t tam; //pedidos grandes (clase -1): tamaño reservado con malloc
+  };
+  int clase; //-1 si no pertenece a ninguna clase
+  int nodo; //pool (nodo NUMA) del que salio, -1 si se reservo con malloc
+} Cabecera;
+
+//FUNCIONES CACHE
+void* reservar(size_t tam);
+
+void* reservar_temporal(size_t tam);
+
+void liberar(void* dato);
+
+void vaciar_cache_local();
+
+size_t memoria_en_uso();
+
+#endif
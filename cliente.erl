@@ -3,7 +3,21 @@
 -define(PUT, 11).
 -define(DEL, 12).
 -define(GET, 13).
+-define(CAS, 14).
+-define(INCR, 15).
+-define(DECR, 16).
+-define(APPEND, 17).
+-define(PREPEND, 18).
+-define(GETS, 19).
 -define(STATS, 21).
+-define(HOTKEYS, 22).
+-define(FLUSH_NS, 24).
+-define(FLUSH_ALL, 25).
+-define(LOCKSTATS, 26).
+-define(LATENCY, 27).
+-define(LATENCY_RESET, 28).
+-define(TRACK, 29).
+-define(LOCKSTATS_RESET, 30).
 -define(OK, 101).
 -define(EINVALID, 111).
 -define(ENOTFOUND, 112).
@@ -11,76 +25,113 @@
 -define(EBIG, 114).
 -define(EUNK, 115).
 -define(OKE, 116).
--export([start/1, connect/1, server_hash/2, put/3, get/2, del/2, stats/1, status/1, server_answer/1, create_msg/4, messenger/2, test_put/2, test_get/2, test_del/2, test_put_large/2, test_get_large/2, test_del_large/2]).
+-define(EVERSION, 117).
+-define(ENONNUM, 118).
+-define(EOVERLOAD, 119).
+-define(INVALIDATE, 130).
+-define(VNODES, 160). %puntos de cada servidor en el anillo
+-export([start/1, connect/1, server_conn/2, server_hash/3, put/3, get/2, del/2, gets/2, cas/4, incr/3, decr/3, append/3, prepend/3, stats/1, hotkeys/1, flush_ns/1, flush_all/1, lockstats/1, lockstats_reset/1, latency/1, latency_reset/1, track/1, status/1, create_msg/4, messenger/3, test_put/2, test_get/2, test_del/2, test_put_large/2, test_get_large/2, test_del_large/2, test_stress/4]).
 
 %lanzamos un proceso por cliente
 start(Servers) -> spawn(?MODULE, connect, [Servers]).
 
-%recibe una lista de IPs (correspondiente a los servers), establece una conexion entre el cliente
-%y cada server creando una lista de pares {socket de la conexion, 0}, el cero se utiliza para contar
-%las claves que el cliente ingresa en cada servidor.
+%recibe una lista de IPs (correspondiente a los servers) y lanza un proceso por
+%servidor que mantiene la conexion (ver server_conn), creando una lista de pares
+%{proceso de la conexion, 0}, el cero se utiliza para contar las claves que el
+%cliente ingresa en cada servidor. las claves se reparten con un anillo de
+%hashing consistente (ver make_ring).
 %Luego, pide un ID por teclado para identificar a cada cliente. 
 %Por ultimo, llama a messenger(), la cual manejará los pedidos.
 connect(Servers) ->
   Connections = lists:map(fun({IP,Port}) ->
-    case gen_tcp:connect(IP, Port, [binary, {active, false}]) of %map que conecta cada servidor, dada su IP
-      {ok, Socket} -> {Socket, 0};
-      {error, Reason} -> {error, Reason}
-    end
+    {spawn_link(?MODULE, server_conn, [IP, Port]), 0}
   end, Servers),
+  Ring = make_ring(Servers),
   
   io:format("~n Ingrese su ID: "),
   Id = io:get_line(""),
   IdSinSalto = string:trim(Id),
   io:format("Ingreso ~p~n", [IdSinSalto]),
-  messenger(Connections,IdSinSalto).
+  messenger(Connections,Ring,IdSinSalto).
 
 %se encarga de manejar envios y respuestas.
 %recibe los pedidos de los clientes, se encarga de asignar un servidor y 
 %crea el mensaje correspondiente para mandarlo al servidor asigando.
-messenger(Connections,Id) ->
+%no espera las respuestas: el proceso de cada conexion las recibe en orden y
+%las muestra, asi los pedidos a uno o varios servidores van seguidos.
+messenger(Connections,Ring,Id) ->
   receive
     {11, Key, Value} ->
-      {AssServer,_ServerCount} = server_hash(Key, Connections), %asigna servidor
+      {AssServer,_ServerCount} = server_hash(Key, Ring, Connections), %asigna servidor
       Msg = create_msg(11,Key,Value,Id), %crea mensaje binario
       %io:format("Armamos el mje: ~p~n", [Msg]),
-      case gen_tcp:send(AssServer, Msg) of
-        {error, Reason} -> exit({error, Reason});
-        ok -> server_answer(AssServer) %espera rta del servidor si se pudo enviar el pedido del cliente
-      end,
-      NewConnections = lists:map(fun({Socket,Count}) -> if Socket == AssServer -> {Socket,Count+1}; %aumenta el numero de claves, por cantidad de puts
-                                                        true -> {Socket,Count} end end, Connections),
-      messenger(NewConnections,Id); %llamada recursiva para mas pedidos
+      AssServer ! {send, Msg, {write, key_id(Id, Key)}}, %la conexion muestra la rta del servidor cuando llegue
+      NewConnections = lists:map(fun({Conn,Count}) -> if Conn == AssServer -> {Conn,Count+1}; %aumenta el numero de claves, por cantidad de puts
+                                                      true -> {Conn,Count} end end, Connections),
+      messenger(NewConnections,Ring,Id); %llamada recursiva para mas pedidos
     {12,Key} ->
-      {AssServer,_ServerCount} = server_hash(Key, Connections), %asigna servidor
+      {AssServer,_ServerCount} = server_hash(Key, Ring, Connections), %asigna servidor
       Msg = create_msg(12,Key,basura,Id), %crea mensaje binario
-      case gen_tcp:send(AssServer, Msg) of
-        {error, Reason} -> exit({error, Reason});
-        ok -> server_answer(AssServer) %espera rta del servidor si se pudo enviar el pedido del cliente
-      end,
-      NewConnections = lists:map(fun({Socket,Count}) -> if Socket == AssServer -> {Socket,Count-1}; %decrementa el numero de claves, por cantidad de dels
-                                                        true -> {Socket,Count} end end, Connections),
-      messenger(NewConnections,Id); %llamada recursiva para mas pedidos
+      AssServer ! {send, Msg, {write, key_id(Id, Key)}},
+      NewConnections = lists:map(fun({Conn,Count}) -> if Conn == AssServer -> {Conn,Count-1}; %decrementa el numero de claves, por cantidad de dels
+                                                      true -> {Conn,Count} end end, Connections),
+      messenger(NewConnections,Ring,Id); %llamada recursiva para mas pedidos
     {13,Key} ->
-      {AssServer,_ServerCount} = server_hash(Key, Connections), %asigna servidor
-      Msg = create_msg(13,Key,basura,Id), %crea mensaje binario
-      case gen_tcp:send(AssServer, Msg) of
-        {error, Reason} -> exit({error, Reason});
-        ok -> server_answer(AssServer) %espera rta del servidor si se pudo enviar el pedido del cliente
+      {AssServer,_ServerCount} = server_hash(Key, Ring, Connections), %asigna servidor
+      case near_cache(key_id(Id, Key), AssServer) of %con track, primero el cache local
+        {ok, Value} -> io:format("OK ~s (cache local)~n", [Value]);
+        none ->
+          Msg = create_msg(13,Key,basura,Id), %crea mensaje binario
+          AssServer ! {send, Msg, {get, key_id(Id, Key)}} %la conexion la guarda en el cache local
+      end,
+      messenger(Connections,Ring,Id); %llamada recursiva para mas pedidos
+    {19,Key} ->
+      {AssServer,_ServerCount} = server_hash(Key, Ring, Connections), %asigna servidor
+      Msg = create_msg(19,Key,basura,Id), %crea mensaje binario
+      AssServer ! {send, Msg, gets}, %la respuesta trae la version del valor
+      messenger(Connections,Ring,Id); %llamada recursiva para mas pedidos
+    {14,Key,Value,Version} ->
+      {AssServer,_ServerCount} = server_hash(Key, Ring, Connections), %asigna servidor
+      Msg = create_msg(14,Key,{Value,Version},Id), %crea mensaje binario
+      AssServer ! {send, Msg, {write, key_id(Id, Key)}},
+      messenger(Connections,Ring,Id); %llamada recursiva para mas pedidos
+    {Com,Key,Arg} when Com == ?INCR; Com == ?DECR; Com == ?APPEND; Com == ?PREPEND ->
+      {AssServer,_ServerCount} = server_hash(Key, Ring, Connections), %asigna servidor
+      Msg = create_msg(Com,Key,Arg,Id), %crea mensaje binario
+      AssServer ! {send, Msg, {write, key_id(Id, Key)}},
+      messenger(Connections,Ring,Id); %llamada recursiva para mas pedidos
+    {Com} when Com == ?STATS; Com == ?HOTKEYS; Com == ?LOCKSTATS; Com == ?LOCKSTATS_RESET; Com == ?LATENCY; Com == ?LATENCY_RESET ->
+      Msg = <<Com:8>>,
+      lists:foreach(fun({Conn,_Count}) -> Conn ! {send, Msg, print} end, Connections), %a todos los servidores
+      messenger(Connections,Ring,Id); %llamada recursiva para mas pedidos
+    {24} ->
+      Espacio = list_to_binary(Id), %el espacio de nombres del cliente es su Id
+      Msg = <<?FLUSH_NS:8, (byte_size(Espacio)):32/big, Espacio/binary>>,
+      NewConnections = lists:map(fun({Conn,_Count}) -> 
+        Conn ! {send, Msg, {write, all}},
+        {Conn,0} %ya no quedan claves del cliente en el servidor
+      end, Connections),
+      messenger(NewConnections,Ring,Id); %llamada recursiva para mas pedidos
+    {25} ->
+      Msg = <<?FLUSH_ALL:8>>,
+      NewConnections = lists:map(fun({Conn,_Count}) -> 
+        Conn ! {send, Msg, {write, all}},
+        {Conn,0}
+      end, Connections),
+      messenger(NewConnections,Ring,Id); %llamada recursiva para mas pedidos
+    {29} ->
+      Table = case get(near_cache) of %el cache local vive mientras viva el proceso
+        undefined -> T = ets:new(near_cache, [set, public]), put(near_cache, T), T;
+        T -> T
       end,
-      messenger(Connections,Id); %llamada recursiva para mas pedidos
-    {21} ->
-      Msg = <<?STATS:8>>,
-      lists:map(fun({Socket,_Count}) -> 
-        case gen_tcp:send(Socket, Msg) of 
-          {error, Reason} -> exit({error, Reason});
-          ok -> server_answer(Socket) %espera rta del servidor si se pudo enviar el pedido del cliente
-        end
+      lists:foreach(fun({Conn,_Count}) ->
+        Conn ! {cache, Table}, %las conexiones lo actualizan con los avisos
+        Conn ! {send, <<?TRACK:8>>, print}
       end, Connections),
-      messenger(Connections,Id); %llamada recursiva para mas pedidos
+      messenger(Connections,Ring,Id); %llamada recursiva para mas pedidos
     {status} ->
       calculate_percentages(Connections),
-      messenger(Connections,Id); %llamada recursiva para mas pedidos
+      messenger(Connections,Ring,Id); %llamada recursiva para mas pedidos
     _ -> ok
   end.
 
@@ -143,6 +194,116 @@ test_del(N, Pid) ->
   Str = integer_to_list(N),
   del(Pid, Str),
   test_del(N-1, Pid).
+
+%prueba de concurrencia: NProcs procesos, cada uno con su conexion al servidor
+%{IP,Port}, hacen NOps PUT/GET/DEL al azar sobre NKeys claves, y despues se
+%chequea que la historia de cada clave sea linealizable.
+%para forzar desalojos correr el servidor con poca memoria y pocas claves
+%grandes (p. ej. -m 8 y NKeys 2000), y compilado con make tsan para que
+%ThreadSanitizer avise las carreras del lado del servidor.
+%make stress hace todo eso y falla si algo no pasa.
+%retorna true si todas las claves pasaron.
+test_stress({IP,Port}, NProcs, NOps, NKeys) ->
+  Parent = self(),
+  Pids = [spawn_link(fun() -> stress_worker(Parent, IP, Port, N, NOps, NKeys) end) || N <- lists:seq(1, NProcs)],
+  History = lists:append([receive {history, Pid, H} -> H end || Pid <- Pids]),
+  ByKey = lists:foldl(fun(Op = {Key,_,_,_,_,_}, M) ->
+    maps:update_with(Key, fun(L) -> [Op|L] end, [Op], M)
+  end, #{}, History),
+  Bad = [Key || {Key, Ops} <- maps:to_list(ByKey), not linearizable(Ops)],
+  io:format("~p operaciones sobre ~p claves, no linealizables: ~p~n", [length(History), maps:size(ByKey), Bad]),
+  Bad == [].
+
+%hace los pedidos de un proceso de test_stress y le manda su historia:
+%una lista de {clave, inicio, fin, operacion, argumento, resultado}
+stress_worker(Parent, IP, Port, N, NOps, NKeys) ->
+  {ok, Socket} = gen_tcp:connect(IP, Port, [binary, {active, false}]),
+  rand:seed(exsss, {N, N * 7, N * 13}),
+  H = stress_ops(Socket, N, NOps, NKeys, []),
+  gen_tcp:close(Socket),
+  Parent ! {history, self(), H}.
+
+stress_ops(_, _, 0, _, H) -> H;
+stress_ops(Socket, N, I, NKeys, H) ->
+  K = integer_to_list(rand:uniform(NKeys)),
+  R = rand:uniform(),
+  {Op, Arg, Msg} =
+    if
+      R < 0.4 -> %valores distintos en cada PUT, para saber cual leyo cada GET
+        V = integer_to_list(N) ++ "-" ++ integer_to_list(I) ++ "-" ++ lists:duplicate(rand:uniform(4096), $v),
+        {put, list_to_binary(V), create_msg(?PUT, K, V, "stress")};
+      R < 0.9 -> {get, none, create_msg(?GET, K, basura, "stress")};
+      true -> {del, none, create_msg(?DEL, K, basura, "stress")}
+    end,
+  Start = erlang:monotonic_time(),
+  ok = gen_tcp:send(Socket, Msg),
+  Result = stress_answer(Socket),
+  End = erlang:monotonic_time(),
+  case Result of
+    overload -> stress_ops(Socket, N, I - 1, NKeys, H); %descartado sin ejecutarse
+    unknown -> stress_ops(Socket, N, I - 1, NKeys, [{K, Start, infinity, Op, Arg, unknown} | H]);
+    _ -> stress_ops(Socket, N, I - 1, NKeys, [{K, Start, End, Op, Arg, Result} | H])
+  end.
+
+%recibe la respuesta de un pedido de test_stress, sin imprimirla
+stress_answer(Socket) ->
+  case gen_tcp:recv(Socket, 1) of
+    {ok, <<?OK>>} -> ok;
+    {ok, <<?ENOTFOUND>>} -> notfound;
+    {ok, <<?EOVERLOAD>>} -> overload;
+    {ok, <<?OKE>>} ->
+      {ok, <<Len:32/integer>>} = gen_tcp:recv(Socket, 4),
+      {ok, V} = gen_tcp:recv(Socket, Len),
+      {value, V};
+    {ok, _} -> unknown; %p. ej. EUNK: no sabemos si se aplico
+    {error, Reason} -> exit({error, Reason})
+  end.
+
+%chequea que la historia de una clave sea linealizable para un registro que
+%la cache puede vaciar en cualquier momento (un desalojo es un DEL que nadie pidio).
+%busqueda de Wing y Gong: la siguiente operacion de la linealizacion tiene que
+%haber empezado antes de que termine alguna de las pendientes; se aplica al
+%modelo y se sigue. los estados {pendientes, valor} que ya fallaron se recuerdan.
+linearizable(Ops) ->
+  Pending = lists:zip(lists:seq(1, length(Ops)), lists:keysort(2, Ops)),
+  Visited = ets:new(visitados, [set, private]),
+  R = lin_search(Pending, absent, Visited),
+  ets:delete(Visited),
+  R.
+
+lin_search(Pending, State, Visited) ->
+  case [X || X = {_, {_,_,_,_,_,Res}} <- Pending, Res /= unknown] of
+    [] -> true; %las que quedan pueden no haberse aplicado nunca
+    Known ->
+      Memo = {[I || {I,_} <- Pending], State},
+      case ets:member(Visited, Memo) of
+        true -> false;
+        false ->
+          MinEnd = lists:min([End || {_, {_,_,End,_,_,_}} <- Known]),
+          Candidates = [X || X = {_, {_,Start,_,_,_,_}} <- Pending, Start < MinEnd],
+          R = lists:any(fun(X = {_, Op}) ->
+            case lin_step(Op, State) of
+              {ok, New} -> lin_search(lists:delete(X, Pending), New, Visited);
+              error -> false
+            end
+          end, Candidates),
+          case R of
+            false -> ets:insert(Visited, {Memo});
+            true -> ok
+          end,
+          R
+      end
+  end.
+
+%aplica la operacion al modelo: retorna {ok, estado nuevo} o error si el
+%resultado observado no es posible desde State
+lin_step({_,_,_,put,V,_}, _) -> {ok, V};
+lin_step({_,_,_,get,_,{value,V}}, V) -> {ok, V};
+lin_step({_,_,_,get,_,{value,_}}, _) -> error;
+lin_step({_,_,_,get,_,notfound}, _) -> {ok, absent}; %no estaba o se desalojo
+lin_step({_,_,_,get,_,unknown}, State) -> {ok, State};
+lin_step({_,_,_,del,_,ok}, absent) -> error;
+lin_step({_,_,_,del,_,_}, _) -> {ok, absent}.
 %---------------------------------------- funciones para testeo
 
 %funcion utilizada por el cliente para ingresar un par {clave,valor}.
@@ -163,6 +324,43 @@ get(Pid,K) ->
 del(Pid,K) -> 
   Pid ! {12,K}.
 
+%como get, pero ademas muestra la version del valor, para usar en cas.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+gets(Pid,K) ->
+  Pid ! {19,K}.
+
+%reemplaza el valor de la clave solo si su version sigue siendo Version
+%(la que devolvio gets), si no responde que la version no coincide.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+cas(Pid,K,V,Version) ->
+  Pid ! {14,K,V,Version}.
+
+%suma N (entero >= 0) al valor numerico de la clave, en el servidor.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+incr(Pid,K,N) ->
+  Pid ! {15,K,N}.
+
+%resta N al valor numerico de la clave (no baja de 0), en el servidor.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+decr(Pid,K,N) ->
+  Pid ! {16,K,N}.
+
+%agrega V al final del valor de la clave, en el servidor.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+append(Pid,K,V) ->
+  Pid ! {17,K,V}.
+
+%agrega V al principio del valor de la clave, en el servidor.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+prepend(Pid,K,V) ->
+  Pid ! {18,K,V}.
+
 %funcion para ver el estado de los servidor conectados, la cantidad
 %de claves ingresada por el cliente.
 %la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
@@ -176,43 +374,237 @@ status(Pid) ->
 stats(Pid) ->
   Pid ! {21}.
 
-%recibe la respuesta del servidor al cliente.
-server_answer(Socket) ->
-  case gen_tcp:recv(Socket, 1) of  % Leer solo el primer byte (código)
-    {error, Reason} -> exit({error, Reason});
-    {ok, <<?OK>>} -> io:format("OK~n");
-    {ok, <<?EINVALID>>} -> io:format("Error: Comando inválido~n");
-    {ok, <<?ENOTFOUND>>} -> io:format("Error: Clave no encontrada~n");
-    {ok, <<?EBIG>>} -> io:format("Error: Valor demasiado grande~n");
-    {ok, <<?EUNK>>} -> io:format("Error: Error desconocido~n");
-    {ok, <<?OKE>>} ->  % "OKE": el servidor envía longitud + valor/estadísticas
-          case gen_tcp:recv(Socket, 4) of  % Leer los 4 bytes de la longitud
-            {ok, <<Len:32/integer>>} -> 
-              case gen_tcp:recv(Socket, Len) of  % Leer el valor completo
-                {ok, Rta} -> io:format("OK ~s~n", [Rta]);
-                {error, Reason} -> exit({error, {rta_no_recibida, Reason}})
-              end;
-            {error, Reason} -> exit({error, {longitud_no_recibida, Reason}})
-          end;
-    _ -> io:format("Respuesta inesperada del servidor~n")
+%funcion para ver las claves mas accedidas de cada servidor, con su tasa
+%estimada de accesos por segundo y el stripe de locks que las protege.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+hotkeys(Pid) ->
+  Pid ! {22}.
+
+%funcion para ver cuanto se espero por los locks de cada servidor y sus
+%secciones mas disputadas (los servidores tienen que correr con -P).
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+lockstats(Pid) ->
+  Pid ! {26}.
+
+%funcion para reiniciar los contadores de los locks de cada servidor.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+lockstats_reset(Pid) ->
+  Pid ! {30}.
+
+%funcion para ver los percentiles de latencia de cada comando en cada servidor,
+%separando aciertos (HIT) de fallos (MISS).
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+latency(Pid) ->
+  Pid ! {27}.
+
+%funcion para reiniciar los histogramas de latencia de cada servidor.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+latency_reset(Pid) ->
+  Pid ! {28}.
+
+%funcion para activar el cache local: los servidores avisan cuando cambia una clave
+%que el cliente leyo, y hasta entonces get/2 la sirve sin ir al servidor.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+track(Pid) ->
+  Pid ! {29}.
+
+%funcion para borrar todas las claves que ingreso el cliente, en todos los servidores.
+%el servidor no las recorre: invalida el espacio de nombres del cliente de una vez.
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+flush_ns(Pid) ->
+  Pid ! {24}.
+
+%funcion para borrar todas las claves de todos los servidores (de todos los clientes).
+%la funcion tmb recibe el Pid de la conexion para poder mandar el pedido
+%al messenger() que se encarga de ellos.
+flush_all(Pid) ->
+  Pid ! {25}.
+
+%---------------------------------------- conexion con cada servidor
+%proceso que mantiene la conexion con un servidor. manda cada pedido apenas
+%llega, sin esperar las respuestas anteriores, y encola que hacer con su
+%respuesta: el servidor responde los pedidos de una conexion en orden, asi que
+%la primera respuesta que llega es la del primero de la cola.
+%con track, mantiene el cache local con los avisos del servidor.
+server_conn(IP, Port) ->
+  case gen_tcp:connect(IP, Port, [binary, {active, once}, {nodelay, true}]) of
+    {ok, Socket} -> conn_loop(Socket, queue:new(), <<>>, none);
+    {error, Reason} -> exit({error, Reason})
   end.
 
+conn_loop(Socket, Queue, Buffer, Cache) ->
+  receive
+    {send, Msg, Kind} -> %Kind: print | gets | {get, Clave} | {write, Clave | all}
+      case gen_tcp:send(Socket, Msg) of
+        ok -> conn_loop(Socket, queue:in(get_kind(Kind, Cache), written(Kind, Queue, Cache)), Buffer, Cache);
+        {error, Reason} -> exit({error, Reason})
+      end;
+    {tcp, Socket, Data} ->
+      inet:setopts(Socket, [{active, once}]),
+      {NewQueue, Rest} = parse_replies(<<Buffer/binary, Data/binary>>, Queue, Cache),
+      conn_loop(Socket, NewQueue, Rest, Cache);
+    {tcp_closed, Socket} ->
+      exit({error, closed}); %p. ej. el servidor nos cerro por no leer los avisos
+    {cache, Table} ->
+      conn_loop(Socket, Queue, Buffer, Table);
+    {sync, From} -> %los mensajes anteriores (y sus avisos) ya se procesaron
+      From ! {synced, self()},
+      conn_loop(Socket, Queue, Buffer, Cache)
+  end.
+
+%los get solo se guardan en el cache local con track
+get_kind({get, Key}, none) -> {get, Key, none};
+get_kind({get, Key}, Table) -> {get, Key, Table};
+get_kind({write, _}, _) -> print;
+get_kind(Kind, _) -> Kind.
+
+%un pedido que modifica la clave (o todas, con FLUSH) la saca del cache local,
+%y los get que esperan respuesta ya no la guardan: asi un get posterior del
+%mismo cliente no lee el valor viejo antes de que llegue el aviso del servidor
+written({write, Key}, Queue, Cache) ->
+  forget(Key, Cache),
+  invalidate_pending(Key, Queue);
+written(_, Queue, _) -> Queue.
+
+%saca de la cola que hacer con la proxima respuesta. si no hay pedidos
+%esperando (p. ej. el EOVERLOAD que manda el servidor antes de cerrar una
+%conexion de mas) la respuesta solo se muestra
+next_kind(Queue) ->
+  case queue:out(Queue) of
+    {{value, Kind}, NewQueue} -> {Kind, NewQueue};
+    {empty, Queue} -> {print, Queue}
+  end.
+
+%procesa las respuestas y avisos completos del buffer.
+%retorna la cola de pedidos que siguen esperando y lo que sobro del buffer.
+parse_replies(<<?INVALIDATE, 0:32, Rest/binary>>, Queue, Cache) -> %FLUSH: todas las claves
+  forget(all, Cache),
+  parse_replies(Rest, invalidate_pending(all, Queue), Cache);
+parse_replies(<<?INVALIDATE, Len:32, Key:Len/binary, Rest/binary>>, Queue, Cache) ->
+  forget(Key, Cache),
+  parse_replies(Rest, invalidate_pending(Key, Queue), Cache);
+parse_replies(Buffer = <<?INVALIDATE, _/binary>>, Queue, _) -> {Queue, Buffer}; %aviso incompleto
+parse_replies(<<?OKE, Len:32, Data:Len/binary, Rest/binary>>, Queue, Cache) ->
+  {Kind, NewQueue} = next_kind(Queue),
+  answer(Kind, {value, Data}),
+  parse_replies(Rest, NewQueue, Cache);
+parse_replies(Buffer = <<?OKE, _/binary>>, Queue, _) -> {Queue, Buffer}; %respuesta incompleta
+parse_replies(<<Code, Rest/binary>>, Queue, Cache) ->
+  {Kind, NewQueue} = next_kind(Queue),
+  answer(Kind, Code),
+  parse_replies(Rest, NewQueue, Cache);
+parse_replies(<<>>, Queue, _) -> {Queue, <<>>}.
+
+%muestra la respuesta del servidor al cliente
+%(y con track guarda el valor de un get en el cache local)
+answer({get, Key, Table}, Reply = {value, Value}) ->
+  print_reply(Reply),
+  case Table of
+    none -> ok;
+    _ -> ets:insert(Table, {Key, Value})
+  end;
+answer(gets, {value, <<Version:64/big, Value/binary>>}) ->
+  io:format("OK ~s (version ~p)~n", [Value, Version]);
+answer(_, Reply) ->
+  print_reply(Reply).
+
+print_reply({value, Rta}) -> io:format("OK ~s~n", [Rta]); %OKE: longitud + valor/estadísticas
+print_reply(?OK) -> io:format("OK~n");
+print_reply(?EINVALID) -> io:format("Error: Comando inválido~n");
+print_reply(?ENOTFOUND) -> io:format("Error: Clave no encontrada~n");
+print_reply(?EBIG) -> io:format("Error: Valor demasiado grande~n");
+print_reply(?EUNK) -> io:format("Error: Error desconocido~n");
+print_reply(?EVERSION) -> io:format("Error: La version no coincide~n");
+print_reply(?ENONNUM) -> io:format("Error: El valor no es numerico~n");
+print_reply(?EOVERLOAD) -> io:format("Error: Servidor sobrecargado, reintentar~n");
+print_reply(_) -> io:format("Respuesta inesperada del servidor~n").
+
+%borra la clave (o todas) del cache local
+forget(_, none) -> ok;
+forget(all, Table) -> ets:delete_all_objects(Table);
+forget(Key, Table) -> ets:delete(Table, Key).
+
+%el servidor anota la clave de un get antes de buscarla, asi que si cambia
+%mientras esperamos la respuesta el aviso llega antes: esa respuesta no se guarda
+invalidate_pending(Key, Queue) ->
+  queue:filter(fun({get, K, _}) when Key == all; K == Key -> [{get, K, none}];
+                  (_) -> true
+               end, Queue).
+
+%busca la clave en el cache local (solo con track).
+%antes espera que la conexion del servidor de la clave procese los avisos que
+%ya le llegaron.
+near_cache(Key, Conn) ->
+  case get(near_cache) of
+    undefined -> none;
+    Table ->
+      Conn ! {sync, self()},
+      receive {synced, Conn} -> ok end,
+      case ets:lookup(Table, Key) of
+        [{_, Value}] -> {ok, Value};
+        [] -> none
+      end
+  end.
+
+%---------------------------------------- anillo de hashing consistente
+%arma el anillo (como ketama): cada servidor ocupa ?VNODES puntos, calculados
+%con md5 a partir de su direccion, y una clave va al primer punto que le sigue.
+%agregar o sacar un servidor solo mueve las claves de los arcos que gana o
+%pierde (~1/n), en lugar de casi todas como con phash2(K, length(Connections)).
+make_ring(Servers) ->
+  Points = lists:append([[{Point, N} || Point <- server_points(Server)]
+                         || {N, Server} <- lists:zip(lists:seq(1, length(Servers)), Servers)]),
+  gb_trees:from_orddict(lists:ukeysort(1, Points)).
+
+%?VNODES puntos del servidor: cada md5 de "host:puerto-i" da 4
+server_points({IP, Port}) ->
+  Name = host_name(IP) ++ ":" ++ integer_to_list(Port),
+  lists:append([ketama_points(erlang:md5(Name ++ "-" ++ integer_to_list(I)))
+                || I <- lists:seq(0, ?VNODES div 4 - 1)]).
+
+ketama_points(<<A:32/little, B:32/little, C:32/little, D:32/little>>) -> [A, B, C, D].
+
+host_name(IP) when is_tuple(IP) -> inet:ntoa(IP);
+host_name(IP) when is_atom(IP) -> atom_to_list(IP);
+host_name(IP) -> IP.
+
+%asigna el servidor: el del primer punto del anillo desde el hash de la clave
+server_hash(K, Ring, Connections) ->
+  <<Hash:32/little, _/binary>> = erlang:md5(K),
+  N = case gb_trees:next(gb_trees:iterator_from(Hash, Ring)) of
+    {_Point, Server, _} -> Server;
+    none -> {_Point, Server} = gb_trees:smallest(Ring), Server %damos la vuelta
+  end,
+  lists:nth(N, Connections).
+
 
-%asigna el servidor.
-server_hash(K, Connections) ->
-  Hash = erlang:phash2(K, length(Connections)),
-  lists:nth(Hash+1,Connections).
+%clave con el espacio de nombres del cliente, como la guarda el servidor
+key_id(Id, K) -> list_to_binary(Id ++ ":" ++ K).
 
 %crea el mensaje para enviar el pedido al servidor.
+%la clave va con el Id del cliente como espacio de nombres: "Id:clave".
 create_msg(Com,K,V,Id) ->
-  Key = string:concat(Id,K),
+  Key = Id ++ ":" ++ K,
   KeyId = list_to_binary(Key),
   if 
-    Com == 11 ->
+    Com == ?PUT; Com == ?APPEND; Com == ?PREPEND ->
       Value = list_to_binary(V),
       KeySize = <<(byte_size(KeyId)):32/big>>,
       ValueSize = <<(byte_size(Value)):32/big>>,
-      <<?PUT:8, KeySize/binary, KeyId/binary, ValueSize/binary, Value/binary>>;
+      <<Com:8, KeySize/binary, KeyId/binary, ValueSize/binary, Value/binary>>;
+    Com == ?CAS -> %V = {valor, version}
+      {Val, Version} = V,
+      Value = list_to_binary(Val),
+      <<?CAS:8, (byte_size(KeyId)):32/big, KeyId/binary, (byte_size(Value)):32/big, Value/binary, Version:64/big>>;
+    Com == ?INCR; Com == ?DECR -> %V = delta
+      <<Com:8, (byte_size(KeyId)):32/big, KeyId/binary, V:64/big>>;
     true ->
       <<Com:8, (byte_size(KeyId)):32/big, KeyId/binary>>
   end.
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "cliente_local.h"
+
+//envia bytes por el anillo de pedidos
+static int enviar(ClienteLocal cl, const void* buf, size_t n) {
+  return anillo_escribir(&cl->region->pedidos, buf, n, &cl->region->cerrado, cl->sock);
+}
+
+//recibe bytes del anillo de respuestas
+static int recibir(ClienteLocal cl, void* buf, size_t n) {
+  return anillo_leer(&cl->region->respuestas, buf, n, &cl->region->cerrado, cl->sock);
+}
+
+//envia un pedido: comando + (longitud + bytes) por cada argumento
+static int enviar_pedido(ClienteLocal cl, char comando, const char* clave, int lenClave, const char* valor, int lenValor) {
+  
+  if (enviar(cl, &comando, 1) < 0) return -1;
+  
+  if (clave != NULL) {
+    uint32_t len = htonl(lenClave);
+    if (enviar(cl, &len, 4) < 0 || enviar(cl, clave, lenClave) < 0) return -1;
+  }
+  if (valor != NULL) {
+    uint32_t len = htonl(lenValor);
+    if (enviar(cl, &len, 4) < 0 || enviar(cl, valor, lenValor) < 0) return -1;
+  }
+  return 0;
+}
+
+//recibe la respuesta. si es OKE, reserva y devuelve el contenido en *datos.
+//retorna el codigo de respuesta o -1 si se cerro la conexion.
+static int recibir_respuesta(ClienteLocal cl, char** datos, int* len) {
+  
+  unsigned char codigo;
+  if (recibir(cl, &codigo, 1) < 0) return -1;
+  
+  if (codigo == OKE) {
+    uint32_t lenNet;
+    if (recibir(cl, &lenNet, 4) < 0) return -1;
+    int n = ntohl(lenNet);
+    char* buf = malloc(n + 1);
+    if (buf == NULL || recibir(cl, buf, n) < 0) {
+      free(buf);
+      return -1;
+    }
+    buf[n] = '\0';
+    if (datos != NULL) {
+      *datos = buf;
+      *len = n;
+    } else {
+      free(buf);
+    }
+  }
+  return codigo;
+}
+
+//se conecta al servidor por el socket unix de la ruta dada y
+//establece la region compartida. retorna NULL si falla.
+ClienteLocal conectar_local(const char* ruta) {
+  
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, ruta, sizeof(sa.sun_path) - 1);
+  
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) return NULL;
+  if (connect(sock, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+    close(sock);
+    return NULL;
+  }
+  
+  //creamos la region compartida, sellada para que su tamaño no cambie
+  //(el servidor rechaza una region que se pueda achicar)
+  int fd = memfd_create("memcached-anillo", MFD_ALLOW_SEALING);
+  if (fd < 0 || ftruncate(fd, sizeof(RegionCompartida)) < 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+    if (fd >= 0) close(fd);
+    close(sock);
+    return NULL;
+  }
+  RegionCompartida* region = mmap(NULL, sizeof(RegionCompartida), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (region == MAP_FAILED) {
+    close(fd);
+    close(sock);
+    return NULL;
+  }
+  
+  //le pasamos el fd de la region al servidor junto con el comando SHM
+  char comando = SHM;
+  struct iovec iov = {.iov_base = &comando, .iov_len = 1};
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  
+  char rta = 0;
+  if (sendmsg(sock, &msg, 0) != 1 || read(sock, &rta, 1) != 1 || rta != OK) {
+    munmap(region, sizeof(RegionCompartida));
+    close(fd);
+    close(sock);
+    return NULL;
+  }
+  close(fd); //el servidor ya tiene su copia mapeada
+  
+  ClienteLocal cl = malloc(sizeof(struct _clienteLocal));
+  cl->sock = sock;
+  cl->region = region;
+  return cl;
+}
+
+//PUT clave valor. retorna el codigo de respuesta (OK) o -1
+int put_local(ClienteLocal cl, const char* clave, int lenClave, const char* valor, int lenValor) {
+  if (enviar_pedido(cl, PUT, clave, lenClave, valor, lenValor) < 0) return -1;
+  return recibir_respuesta(cl, NULL, NULL);
+}
+
+//GET clave. si la encuentra retorna OKE y deja en *valor una copia
+//(a liberar con free) y su longitud en *lenValor
+int get_local(ClienteLocal cl, const char* clave, int lenClave, char** valor, int* lenValor) {
+  if (enviar_pedido(cl, GET, clave, lenClave, NULL, 0) < 0) return -1;
+  return recibir_respuesta(cl, valor, lenValor);
+}
+
+//DEL clave. retorna OK, ENOTFOUND o -1
+int del_local(ClienteLocal cl, const char* clave, int lenClave) {
+  if (enviar_pedido(cl, DEL, clave, lenClave, NULL, 0) < 0) return -1;
+  return recibir_respuesta(cl, NULL, NULL);
+}
+
+//STATS. deja en *stats el texto de las estadisticas (a liberar con free)
+int stats_local(ClienteLocal cl, char** stats, int* len) {
+  if (enviar_pedido(cl, STATS, NULL, 0, NULL, 0) < 0) return -1;
+  return recibir_respuesta(cl, stats, len);
+}
+
+//cierra la conexion y libera la region
+void cerrar_local(ClienteLocal cl) {
+  __atomic_store_n(&cl->region->cerrado, 1, __ATOMIC_RELEASE);
+  anillo_despertar(&cl->region->pedidos); //el servidor puede estar durmiendo en el anillo
+  munmap(cl->region, sizeof(RegionCompartida));
+  close(cl->sock);
+  free(cl);
+}
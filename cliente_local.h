@@ -0,0 +1,31 @@
+#ifndef __CLIENTE_LOCAL_H__
+#define __CLIENTE_LOCAL_H__
+#include "anillo.h"
+#include "protocolo.h"
+
+//biblioteca para clientes que corren en el mismo host que el servidor.
+//se conecta al socket unix del servidor (opcion -u) y le pasa una region
+//de memoria compartida. los pedidos PUT/GET/DEL/STATS viajan por los anillos
+//de esa region en vez de atravesar el stack TCP.
+//una conexion no debe usarse desde varios threads a la vez.
+
+//conexion local
+typedef struct _clienteLocal {
+  int sock; //socket unix, solo se usa para el handshake y detectar el cierre
+  RegionCompartida* region;
+} *ClienteLocal;
+
+//FUNCIONES CLIENTE LOCAL
+ClienteLocal conectar_local(const char* ruta);
+
+int put_local(ClienteLocal cl, const char* clave, int lenClave, const char* valor, int lenValor);
+
+int get_local(ClienteLocal cl, const char* clave, int lenClave, char** valor, int* lenValor);
+
+int del_local(ClienteLocal cl, const char* clave, int lenClave);
+
+int stats_local(ClienteLocal cl, char** stats, int* len);
+
+void cerrar_local(ClienteLocal cl);
+
+#endif
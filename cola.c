@@ -0,0 +1,36 @@
+#include <stddef.h>
+#include "cola.h"
+
+//inicializa una cola vacia
+void crear_cola(ColaSPSC* c) {
+  c->escritos = 0;
+  c->leidos = 0;
+}
+
+//agrega elem al final de la cola (solo lo llama el productor).
+//retorna 0, o -1 si la cola esta llena.
+int encolar(ColaSPSC* c, void* elem) {
+  
+  unsigned long escritos = c->escritos; //solo lo modifica el productor
+  unsigned long leidos = __atomic_load_n(&c->leidos, __ATOMIC_ACQUIRE);
+  
+  if (escritos - leidos == TAM_COLA) return -1;
+  
+  c->elems[escritos & (TAM_COLA - 1)] = elem;
+  __atomic_store_n(&c->escritos, escritos + 1, __ATOMIC_RELEASE); //publicamos el elemento
+  return 0;
+}
+
+//saca el primer elemento de la cola (solo lo llama el consumidor).
+//retorna NULL si la cola esta vacia.
+void* desencolar(ColaSPSC* c) {
+  
+  unsigned long leidos = c->leidos; //solo lo modifica el consumidor
+  unsigned long escritos = __atomic_load_n(&c->escritos, __ATOMIC_ACQUIRE);
+  
+  if (leidos == escritos) return NULL;
+  
+  void* elem = c->elems[leidos & (TAM_COLA - 1)];
+  __atomic_store_n(&c->leidos, leidos + 1, __ATOMIC_RELEASE); //liberamos el lugar
+  return elem;
+}
@@ -0,0 +1,26 @@
+#ifndef __COLA_H__
+#define __COLA_H__
+
+//cola de punteros de un solo productor y un solo consumidor, sin locks.
+//la usan los workers en modo particionado para pasarse pedidos.
+
+#define TAM_COLA 1024 //elementos (potencia de 2)
+
+//escritos y leidos son contadores totales,
+//separados en lineas de cache distintas.
+typedef struct _colaSPSC {
+  unsigned long escritos;
+  char relleno1[56];
+  unsigned long leidos;
+  char relleno2[56];
+  void* elems[TAM_COLA];
+} ColaSPSC;
+
+//FUNCIONES COLA
+void crear_cola(ColaSPSC* c);
+
+int encolar(ColaSPSC* c, void* elem);
+
+void* desencolar(ColaSPSC* c);
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "espacios.h"
+
+//tabla de espacios (listas enlazadas, un lock cada CUBETAS_ESPACIOS / LOCKS_ESPACIOS listas)
+static Espacio* espacios[CUBETAS_ESPACIOS];
+static pthread_mutex_t locks[LOCKS_ESPACIOS];
+static pthread_once_t iniciada = PTHREAD_ONCE_INIT;
+
+//espacios en la tabla
+static long cantidad = 0;
+
+//items con clave "espacio:..." que no tienen espacio porque la tabla estaba
+//llena: mientras haya alguno, FLUSH_NS no puede saber si un espacio no tiene items
+static long sinLugar = 0;
+
+//generacion de todos los items
+static unsigned long generacionGlobal = 0;
+
+static void iniciar_locks() {
+  for (int i = 0; i < LOCKS_ESPACIOS; i++) {
+    pthread_mutex_init(&locks[i], NULL);
+  }
+}
+
+//hash del nombre (los primeros len bytes)
+static unsigned hash_nombre(const char* nombre, int len) {
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)nombre[i]) * 16777619u;
+  }
+  return h;
+}
+
+//largo del nombre del espacio de la clave, 0 si no tiene
+static int largo_espacio(const char* clave) {
+  
+  int len = 0;
+  while (len <= MAX_NOMBRE_ESPACIO && clave[len] != '\0' && clave[len] != SEPARADOR_ESPACIO) {
+    len++;
+  }
+  if (len == 0 || len > MAX_NOMBRE_ESPACIO || clave[len] != SEPARADOR_ESPACIO) return 0;
+  
+  return len;
+}
+
+//busca el espacio de nombre (los primeros len bytes) en la lista i.
+//debe tenerse el lock de la lista
+static Espacio* buscar_espacio(unsigned i, const char* nombre, int len) {
+  
+  for (Espacio* e = espacios[i]; e != NULL; e = e->sig) {
+    if (strncmp(e->nombre, nombre, len) == 0 && e->nombre[len] == '\0') return e;
+  }
+  return NULL;
+}
+
+//retorna el espacio de la clave, creandolo si hace falta, y le suma un item:
+//el item debe soltarlo con soltar_espacio cuando se libera.
+//retorna NULL si la clave no tiene espacio (o si la tabla esta llena).
+Espacio* espacio_de(char* clave) {
+  
+  int len = largo_espacio(clave);
+  if (len == 0) return NULL;
+  
+  pthread_once(&iniciada, iniciar_locks);
+  unsigned i = hash_nombre(clave, len) & (CUBETAS_ESPACIOS - 1);
+  pthread_mutex_t* lock = &locks[i % LOCKS_ESPACIOS];
+  
+  pthread_mutex_lock(lock);
+  Espacio* e = buscar_espacio(i, clave, len);
+  
+  if (e == NULL && __atomic_add_fetch(&cantidad, 1, __ATOMIC_RELAXED) <= ESPACIOS) {
+    e = malloc(sizeof(Espacio));
+    char* nombre = malloc(len + 1);
+    if (e != NULL && nombre != NULL) {
+      memcpy(nombre, clave, len);
+      nombre[len] = '\0';
+      e->nombre = nombre;
+      e->generacion = 0;
+      e->items = 0;
+      e->sig = espacios[i];
+      espacios[i] = e;
+    } else {
+      free(e);
+      free(nombre);
+      e = NULL;
+    }
+  }
+  if (e == NULL) { //tabla llena (o sin memoria): el item queda sin espacio
+    __atomic_sub_fetch(&cantidad, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sinLugar, 1, __ATOMIC_RELAXED);
+  }
+  
+  if (e != NULL) e->items++;
+  pthread_mutex_unlock(lock);
+  
+  return e;
+}
+
+//resta el item de clave a su espacio (el que le dio espacio_de),
+//y libera el espacio si era el ultimo
+void soltar_espacio(Espacio* espacio, char* clave) {
+  
+  if (espacio == NULL) {
+    if (largo_espacio(clave) > 0) __atomic_sub_fetch(&sinLugar, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  
+  int len = strlen(espacio->nombre);
+  unsigned i = hash_nombre(espacio->nombre, len) & (CUBETAS_ESPACIOS - 1);
+  pthread_mutex_t* lock = &locks[i % LOCKS_ESPACIOS];
+  
+  pthread_mutex_lock(lock);
+  if (--espacio->items > 0) {
+    pthread_mutex_unlock(lock);
+    return;
+  }
+  
+  Espacio** ant = &espacios[i];
+  while (*ant != espacio) ant = &(*ant)->sig;
+  *ant = espacio->sig;
+  pthread_mutex_unlock(lock);
+  
+  __atomic_sub_fetch(&cantidad, 1, __ATOMIC_RELAXED);
+  free(espacio->nombre);
+  free(espacio);
+}
+
+//invalida todos los items del espacio (FLUSH_NS).
+//retorna 1 si el espacio tenia items, 0 si no tenia y -1 si no se sabe
+//(hay items sin espacio porque la tabla se lleno)
+int vaciar_espacio(char* nombre) {
+  
+  pthread_once(&iniciada, iniciar_locks);
+  int len = strlen(nombre);
+  unsigned i = hash_nombre(nombre, len) & (CUBETAS_ESPACIOS - 1);
+  pthread_mutex_t* lock = &locks[i % LOCKS_ESPACIOS];
+  
+  pthread_mutex_lock(lock);
+  Espacio* e = buscar_espacio(i, nombre, len);
+  if (e != NULL) __atomic_add_fetch(&e->generacion, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(lock);
+  
+  if (e != NULL) return 1;
+  return __atomic_load_n(&sinLugar, __ATOMIC_RELAXED) > 0 ? -1 : 0;
+}
+
+//invalida todos los items (FLUSH_ALL)
+void vaciar_todo() {
+  __atomic_add_fetch(&generacionGlobal, 1, __ATOMIC_RELEASE);
+}
+
+//generacion global actual
+unsigned long generacion_global() {
+  return __atomic_load_n(&generacionGlobal, __ATOMIC_ACQUIRE);
+}
+
+//retorna 1 si un item guardado con esas generaciones sigue siendo visible
+int generacion_vigente(Espacio* espacio, unsigned long genEspacio, unsigned long genGlobal) {
+  
+  if (genGlobal != generacion_global()) return 0;
+  
+  return espacio == NULL || genEspacio == __atomic_load_n(&espacio->generacion, __ATOMIC_ACQUIRE);
+}
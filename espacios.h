@@ -0,0 +1,40 @@
+#ifndef __ESPACIOS_H__
+#define __ESPACIOS_H__
+
+//espacios de nombres de las claves.
+//una clave "espacio:resto" pertenece al espacio "espacio" (el cliente
+//erlang prefija asi el Id de cada cliente). cada espacio tiene un numero
+//de generacion y ademas hay una generacion global: FLUSH_NS y FLUSH_ALL
+//solo incrementan la generacion, y los items que se guardaron con una
+//generacion anterior pasan a ser invisibles (los termina sacando el desalojo).
+
+#define ESPACIOS 4096 //espacios con items a la vez como maximo
+#define CUBETAS_ESPACIOS 4096 //listas de la tabla de espacios (potencia de 2)
+#define LOCKS_ESPACIOS 64 //locks de la tabla de espacios (divide a CUBETAS_ESPACIOS)
+#define MAX_NOMBRE_ESPACIO 64 //las claves con un prefijo mas largo no tienen espacio
+#define SEPARADOR_ESPACIO ':'
+
+//espacio de nombres.
+//cada item guarda un puntero a su espacio y cuenta en items: el espacio
+//se libera cuando se libera su ultimo item.
+typedef struct _espacio {
+  char* nombre;
+  unsigned long generacion;
+  long items; //items que lo referencian (protegido por el lock de su lista)
+  struct _espacio* sig;
+} Espacio;
+
+//FUNCIONES ESPACIOS
+Espacio* espacio_de(char* clave);
+
+void soltar_espacio(Espacio* espacio, char* clave);
+
+int vaciar_espacio(char* nombre);
+
+void vaciar_todo();
+
+unsigned long generacion_global();
+
+int generacion_vigente(Espacio* espacio, unsigned long genEspacio, unsigned long genGlobal);
+
+#endif
@@ -3,26 +3,43 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <inttypes.h>
 #include "hash_chaining.h"
 #include "lru.h"
+#include "seguimiento.h"
+#include "respaldo.h"
 
+//ultima version asignada
+static unsigned long long ultimaVersion = 0;
+
+//retorna una version nueva, distinta de todas las anteriores
+static unsigned long long nueva_version() {
+  return __atomic_add_fetch(&ultimaVersion, 1, __ATOMIC_RELAXED);
+}
 
 //crea el comando (par {clave,valor})
 Comando crear_comando(unsigned char* clave, unsigned char* valor, TablaHash tabla, ListaLru lru) {
   Comando com = safe_malloc(sizeof(struct _comando), 1, tabla, lru);
-  com->clave = safe_malloc(sizeof(char), strlen((char*)clave)+1, tabla, lru);
-  strcpy(com->clave, (char*)clave);
+  com->lenClave = strlen((char*)clave);
+  com->clave = safe_malloc(sizeof(char), com->lenClave+1, tabla, lru);
+  memcpy(com->clave, clave, com->lenClave+1);
   com->valor = safe_malloc(sizeof(char), strlen((char*)valor)+1, tabla, lru);
   strcpy(com->valor, (char*)valor);
+  com->version = nueva_version();
+  com->espacio = espacio_de(com->clave);
+  com->genEspacio = com->espacio != NULL ? __atomic_load_n(&com->espacio->generacion, __ATOMIC_ACQUIRE) : 0;
+  com->genGlobal = generacion_global();
   return com;
 }
 
 //libera el comando
 void destrCom(Comando dato) {
   if (dato != NULL) {
-    free(dato->clave);
-    free(dato->valor);
-    free(dato);
+    soltar_espacio(dato->espacio, dato->clave); //el espacio se libera con su ultimo item
+    liberar(dato->clave);
+    liberar(dato->valor);
+    liberar(dato);
   }
 }
 
@@ -31,6 +48,12 @@ int compCom(char* datoClave, char* clave) {
   return (strcmp(datoClave, clave));
 }
 
+//retorna 1 si el comando no fue invalidado por un FLUSH_NS/FLUSH_ALL.
+//los invalidados se tratan como si no estuvieran, hasta que los desaloja la lru
+int comando_vigente(Comando dato) {
+  return generacion_vigente(dato->espacio, dato->genEspacio, dato->genGlobal);
+}
+
 
 //funcion hash de la tablahash
 unsigned funcion_hash(void *string) {
@@ -42,71 +65,164 @@ unsigned funcion_hash(void *string) {
   return num;
 }
 
+//igual a funcion_hash, pero inlineable y guarda el largo de la clave en *len
+static inline unsigned hash_clave(const char* s, unsigned* len) {
+  const char* inicio = s;
+  unsigned num;
+  for (num = 0; *s != '\0'; ++s) {
+    num = *s + 31 * num;
+  }
+  *len = s - inicio;
+  return num;
+}
+
+//hash de la clave segun la variante de la tabla.
+//en la generica el largo no se usa
+static inline unsigned hash_de(TablaHash tabla, char* clave, unsigned* len) {
+  if (tabla->variante == TABLA_GENERICA) {
+    *len = 0;
+    return tabla->hash(clave);
+  }
+  return hash_clave(clave, len);
+}
+
+//lee 8 bytes de la clave, sin requerir que esten alineados
+static inline uint64_t carga64(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+//comparaciones de las variantes especializadas (equivalen a compCom == 0:
+//las claves no tienen '\0' en el medio, asi que el largo y los bytes alcanzan)
+#define IGUALES_LARGO(dato, clave, len) \
+  ((dato)->lenClave == (len) && memcmp((dato)->clave, (clave), (len)) == 0)
+#define IGUALES_8(dato, clave, len) \
+  ((dato)->lenClave == 8 && carga64((dato)->clave) == carga64(clave))
+#define IGUALES_16(dato, clave, len) \
+  ((dato)->lenClave == 16 && carga64((dato)->clave) == carga64(clave) \
+   && carga64((dato)->clave + 8) == carga64((clave) + 8))
+
+//genera buscar_nodo_<variante>: recorre la lista comparando primero el hash
+//guardado en el nodo y despues la clave con IGUALES, todo inlineado
+#define DEFINIR_BUSCAR_NODO(variante, IGUALES) \
+static inline HList* buscar_nodo_##variante(HList* lista, const char* clave, unsigned hash, unsigned len) { \
+  (void) len; \
+  for (HList* temp = lista; temp != NULL; temp = temp->sig) { \
+    if (temp->hash == hash && IGUALES(temp->dato, clave, len)) return temp; \
+  } \
+  return NULL; \
+}
+
+DEFINIR_BUSCAR_NODO(largo, IGUALES_LARGO)
+DEFINIR_BUSCAR_NODO(8, IGUALES_8)
+DEFINIR_BUSCAR_NODO(16, IGUALES_16)
+
+//busqueda generica, por el puntero a la comparadora de la tabla
+static HList* buscar_nodo_generico(HList* lista, char* clave, FuncionComparadora comp) {
+  for (HList* temp = lista; temp != NULL; temp = temp->sig) {
+    if (comp(temp->dato->clave, clave) == 0) return temp;
+  }
+  return NULL;
+}
+
+//busca el nodo de la clave en la lista enlazada con la variante de la tabla,
+//sin marcarlo como activo. hash y len son los que calculo hash_de.
+//en las de largo fijo, las claves de otro largo van por la de largo variable.
+//retorna NULL si no se encuentra
+static inline HList* buscar_nodo(TablaHash tabla, HList* lista, char* clave, unsigned hash, unsigned len) {
+  switch (tabla->variante) {
+    case TABLA_GENERICA:
+      return buscar_nodo_generico(lista, clave, tabla->comp);
+    case TABLA_CLAVE8:
+      if (len == 8) return buscar_nodo_8(lista, clave, hash, len);
+      break;
+    case TABLA_CLAVE16:
+      if (len == 16) return buscar_nodo_16(lista, clave, hash, len);
+      break;
+  }
+  return buscar_nodo_largo(lista, clave, hash, len);
+}
+
 //agrega elementos a la lista enlazada de la tablahash
 //si la clave ya se encontraba, solo agrega el valor nuevo
-//si no se encontraba agrega el nodo
-HList* agregar_lista(HList* lista, Comando dato, ListaLru lru, TablaHash tabla, Stats st) {
+//si no se encontraba agrega el nodo.
+//nuevoNodo se reserva antes de bloquear la seccion, asi un desalojo
+//no puede modificar la lista que estamos recorriendo.
+HList* agregar_lista(HList* lista, Comando dato, HList* nuevoNodo, ListaLru lru, TablaHash tabla, Stats st) {
 
-  HList* nuevoNodo = safe_malloc(sizeof(HList), 1, tabla, lru);
   nuevoNodo->dato = dato;
   
   if (lista == NULL) {
     nuevoNodo->sig = lista;
     
     //bloqueamos la lru y agg el nodo insertado a esta
-    pthread_mutex_lock(&lockLru);
+    bloquear(&lru->lock, &lru->perfil);
     agregar_lru(lru,nuevoNodo);
-    pthread_mutex_unlock(&lockLru);
+    pthread_mutex_unlock(&lru->lock);
     
     //bloqueamos stats y incrementamos la cantidad de claves
-    pthread_mutex_lock(&lockStats);
+    bloquear(&st->lock, &st->perfil);
     st->keys += 1;
-    pthread_mutex_unlock(&lockStats);
+    pthread_mutex_unlock(&st->lock);
     
     return nuevoNodo;
   }
   
-  HList* temp = lista;
-  for (; temp!= NULL; temp = temp->sig) { //verificamos si la clave ya se encontraba en la tablahash
-                                         //en caso de que si, solo se actualiza el valor del par
-    if (!(tabla->comp((void*)temp->dato->clave, (void*)dato->clave))) {
-      
-      tabla->destroy(temp->dato);
-      temp->dato = dato;
-      
-      //como el nodo ya se encontraba,
-      //lo movemos al inicio ya que fue el "ultimo utilizado"
-      pthread_mutex_lock(&lockLru);
-      modificar_lru(lru, temp);
-      pthread_mutex_unlock(&lockLru);
-      
-      free(nuevoNodo);
-      return lista;
-    }
+  //verificamos si la clave ya se encontraba en la tablahash
+  //en caso de que si, solo se actualiza el valor del par
+  HList* temp = buscar_nodo(tabla, lista, dato->clave, nuevoNodo->hash, dato->lenClave);
+  if (temp != NULL) {
+    
+    tabla->destroy(temp->dato);
+    temp->dato = dato;
+    
+    //como el nodo ya se encontraba, lo marcamos como activo
+    //y el mantenedor de la lru se encarga de promoverlo
+    marcar_activo(temp);
+    
+    liberar(nuevoNodo);
+    return lista;
   }
 
   nuevoNodo->sig = lista;
 
   //bloqueamos la lru y agg el nodo insertado a esta
-  pthread_mutex_lock(&lockLru);
+  bloquear(&lru->lock, &lru->perfil);
   agregar_lru(lru,nuevoNodo);
-  pthread_mutex_unlock(&lockLru);
+  pthread_mutex_unlock(&lru->lock);
   
   //bloqueamos stats y incrementamos la cantidad de claves
-  pthread_mutex_lock(&lockStats);
+  bloquear(&st->lock, &st->perfil);
   st->keys += 1;
-  pthread_mutex_unlock(&lockStats);
+  pthread_mutex_unlock(&st->lock);
 
   return nuevoNodo;
 }
 
-//crea la tablahash
-TablaHash crear_tabla (unsigned capacidad, FuncionHash hash, FuncionComparadora comp, FuncionDestructora destroy) {
+//crea la tablahash.
+//si usa funcion_hash y compCom elige una busqueda especializada, con camino
+//rapido para las claves de largoClave bytes si es 8 o 16 (0 = sin largo fijo)
+TablaHash crear_tabla (unsigned capacidad, FuncionHash hash, FuncionComparadora comp, FuncionDestructora destroy, unsigned largoClave) {
   TablaHash tabla = malloc(sizeof(struct _tablahash));
   tabla->capacidad = capacidad;
   tabla->hash = hash;
   tabla->comp = comp;
   tabla->destroy = destroy;
+  if (hash != (FuncionHash) funcion_hash || comp != (FuncionComparadora) compCom) {
+    tabla->variante = TABLA_GENERICA;
+  } else if (largoClave == 8) {
+    tabla->variante = TABLA_CLAVE8;
+  } else if (largoClave == 16) {
+    tabla->variante = TABLA_CLAVE16;
+  } else {
+    tabla->variante = TABLA_LARGO;
+  }
+  tabla->hot = crear_hotkeys();
+  for (int i = 0; i < LOCKS; i++) {
+    pthread_mutex_init(&tabla->locks[i], NULL);
+    iniciar_perfil(&tabla->perfiles[i]);
+  }
   tabla->arreglo = malloc(sizeof (CasillaHash)* capacidad);
   for (unsigned int i = 0; i < tabla->capacidad; i++) {
     tabla->arreglo[i] = NULL;
@@ -121,58 +237,70 @@ void destruir_tabla (TablaHash tabla) {
     while (temp != NULL) {
       CasillaHash siguiente = temp->sig;
       tabla->destroy(temp->dato);
-      free(temp);       
+      liberar(temp);       
       temp = siguiente;
     }
   }
+  destruir_hotkeys(tabla->hot);
   free(tabla->arreglo);
   free(tabla);
 }
 
 
 //busca el valor asociado a la clave pasada como argumento en la lista enlazada.
-//en caso de encontrarlo, lo retorna. 
+//en caso de encontrarlo, lo retorna (y si version no es NULL, guarda ahi su version).
 //caso contrario, retorna NULL
-char *buscar_lista(HList* lista, char* clave, FuncionComparadora comp, ListaLru lru) {
+char *buscar_lista(TablaHash tabla, HList* lista, char* clave, unsigned hash, unsigned len, unsigned long long* version) {
   
-  if (lista == NULL) {
+  HList* temp = buscar_nodo(tabla, lista, clave, hash, len);
+  if (temp == NULL) {
     return NULL; //si no se encuentra la clave
   }
   
-  HList* temp = lista;
-  for (; temp != NULL; temp = temp->sig) {
-    if (comp(temp->dato->clave, clave) == 0) {
-    
-      //el par buscado se encuentra en la tablahash por lo que
-      //movemos dicho par al inicio de la lru ya que fue el "ultimo utilizado"
-      pthread_mutex_lock(&lockLru);
-      modificar_lru(lru, temp);
-      pthread_mutex_unlock(&lockLru);
-      
-      return temp->dato->valor;
-    }
-  }
-  return NULL; //si no se encuentra la clave
+  if (!comando_vigente(temp->dato)) return NULL; //invalidado, no lo marcamos como activo
+  
+  //el par buscado se encuentra en la tablahash por lo que
+  //lo marcamos como activo, sin tomar el lock de la lru.
+  //el mantenedor lo promueve en su proxima pasada
+  marcar_activo(temp);
+  
+  if (version != NULL) *version = temp->dato->version;
+  return temp->dato->valor;
 }
 
 
-//busca la clave en la tablahash (GET "clave") para retornar el valor asociado
-char *buscar_tabla(TablaHash tabla, char* clave, ListaLru lru) {
+//busca la clave en la tablahash (GET "clave") para retornar el valor asociado.
+//si version no es NULL, guarda ahi la version del valor (GETS).
+//retorna una copia del valor hecha con la seccion tomada (un PUT o un desalojo
+//concurrente puede liberar el original apenas la soltamos), que el que llama
+//libera con liberar(). NULL si no esta.
+char *buscar_tabla(TablaHash tabla, char* clave, ListaLru lru, unsigned long long* version) {
   
   if (tabla == NULL) return NULL;
   
-  int idx = tabla->hash(clave) % tabla->capacidad; //indice del array de la hash dnde se escontraria la clave
+  unsigned len;
+  unsigned hash = hash_de(tabla, clave, &len);
+  int idx = hash % tabla->capacidad; //indice del array de la hash dnde se escontraria la clave
   
-  pthread_mutex_lock(&(locks[idx % LOCKS])); //bloqueamos dicha seccion de la tablahash para poder buscar la clave
+  registrar_acceso(lru->sketch, hash); //registramos el acceso en el sketch, aunque sea un miss
+  registrar_hot(tabla->hot, clave, hash, idx % LOCKS); //y en el detector de claves calientes
+  
+  bloquear(&(tabla->locks[idx % LOCKS]), &(tabla->perfiles[idx % LOCKS])); //bloqueamos dicha seccion de la tablahash para poder buscar la clave
   
   if (tabla->arreglo[idx] == NULL) {
-    pthread_mutex_unlock(&(locks[idx % LOCKS])); //como la casilla es NULL, desbloqueamos
+    pthread_mutex_unlock(&(tabla->locks[idx % LOCKS])); //como la casilla es NULL, desbloqueamos
     return NULL;
   }
   else {
-    char* encontrado = buscar_lista(tabla->arreglo[idx], clave, (FuncionComparadora)tabla->comp, lru); //buscamos en la lista
-    pthread_mutex_unlock(&(locks[idx % LOCKS])); //como ya realizamos la busqueda, desbloqueamos
-    return encontrado; //retornamos el valor o NULL
+    char* encontrado = buscar_lista(tabla, tabla->arreglo[idx], clave, hash, len, version); //buscamos en la lista
+    char* copia = NULL;
+    if (encontrado != NULL) { //desalojo() solo usa trylock y saltea esta seccion
+      size_t len = strlen(encontrado);
+      copia = safe_malloc(sizeof(char), len + 1, tabla, lru);
+      memcpy(copia, encontrado, len + 1);
+    }
+    pthread_mutex_unlock(&(tabla->locks[idx % LOCKS])); //como ya realizamos la busqueda, desbloqueamos
+    return copia; //retornamos la copia del valor o NULL
   }
 }  
 
@@ -181,50 +309,81 @@ void insertar_tabla(TablaHash tabla, Comando dato, ListaLru lru, Stats st) {
   
   if (tabla == NULL) return;
   
-  int idx = tabla->hash(dato->clave) % tabla->capacidad; //indice del array de la hash dnde se escontraria la clave
+  unsigned len;
+  unsigned hash = hash_de(tabla, dato->clave, &len);
+  int idx = hash % tabla->capacidad; //indice del array de la hash dnde se escontraria la clave
+  
+  registrar_acceso(lru->sketch, hash); //registramos el acceso en el sketch
+  registrar_hot(tabla->hot, dato->clave, hash, idx % LOCKS); //y en el detector de claves calientes
+  
+  HList* nuevoNodo = safe_malloc(sizeof(HList), 1, tabla, lru); //reservamos el nodo antes de bloquear
+  nuevoNodo->hash = hash;
   
-  pthread_mutex_lock(&(locks[idx % LOCKS])); //bloqueamos dicha seccion de la tablahash para poder buscar la clave
+  bloquear(&(tabla->locks[idx % LOCKS]), &(tabla->perfiles[idx % LOCKS])); //bloqueamos dicha seccion de la tablahash para poder buscar la clave
 
-  tabla->arreglo[idx] = agregar_lista(tabla->arreglo[idx], dato, lru, tabla, st); //agregamos el par en la lista enlazada
+  tabla->arreglo[idx] = agregar_lista(tabla->arreglo[idx], dato, nuevoNodo, lru, tabla, st); //agregamos el par en la lista enlazada
+  invalidar_clave(dato->clave); //avisamos a las conexiones que seguian la clave (TRACK)
+  anotar_escritura(dato->clave, dato->valor); //y la anotamos para el respaldo (-B)
 
-  pthread_mutex_unlock(&(locks[idx % LOCKS])); //una vez que se agrego el par/valor se desbloquea el mutex
+  pthread_mutex_unlock(&(tabla->locks[idx % LOCKS])); //una vez que se agrego el par/valor se desbloquea el mutex
+}
+
+//inserta el comando solo si la clave no esta y limpia(clave) lo permite,
+//evaluado con la seccion tomada (ver clave_limpia en respaldo.h).
+//se usa para guardar lo leido del respaldo: no pisa una escritura posterior
+//ni se anota como escritura, y no es un cambio para los que siguen la clave.
+//retorna 1 si lo inserto; si no, libera dato y retorna 0.
+int insertar_si_falta(TablaHash tabla, Comando dato, ListaLru lru, Stats st, int (*limpia)(char* clave)) {
+  
+  if (tabla == NULL) return 0;
+  
+  unsigned len;
+  unsigned hash = hash_de(tabla, dato->clave, &len);
+  int idx = hash % tabla->capacidad;
+  
+  HList* nuevoNodo = safe_malloc(sizeof(HList), 1, tabla, lru);
+  nuevoNodo->hash = hash;
+  
+  bloquear(&(tabla->locks[idx % LOCKS]), &(tabla->perfiles[idx % LOCKS]));
+  
+  HList* nodo = buscar_nodo(tabla, tabla->arreglo[idx], dato->clave, hash, len);
+  if ((nodo != NULL && comando_vigente(nodo->dato)) || !limpia(dato->clave)) {
+    pthread_mutex_unlock(&(tabla->locks[idx % LOCKS]));
+    liberar(nuevoNodo);
+    tabla->destroy(dato);
+    return 0;
+  }
+  
+  tabla->arreglo[idx] = agregar_lista(tabla->arreglo[idx], dato, nuevoNodo, lru, tabla, st);
+  
+  pthread_mutex_unlock(&(tabla->locks[idx % LOCKS]));
+  return 1;
 }
 
 //elimina el nodo de la lista enlazada de la tablahash
-HList* eliminar_nodo_lista(HList* lista, char* clave, int* flag, FuncionComparadora comp, FuncionDestructora destr, ListaLru lru) {
+HList* eliminar_nodo_lista(TablaHash tabla, HList* lista, char* clave, unsigned hash, unsigned len, int* flag, ListaLru lru) {
+  
+  HList* temp = buscar_nodo(tabla, lista, clave, hash, len);
+  if (temp == NULL) return lista;
   
-  if (lista == NULL) return NULL;
+  //si se encontro el elemento, seteamos la bandera en 1 para indicarlo
+  //(2 si estaba invalidado por un FLUSH, para DEL es como si no estuviera)
+  *flag = comando_vigente(temp->dato) ? 1 : 2;
 
-  HList* temp = lista;
-  HList* anterior = NULL; //llevaremos un puntero al anterior para reacomodar punteros al eliminar
+  //lo sacamos de la lista por puntero
+  HList** ant = &lista;
+  while (*ant != temp) ant = &(*ant)->sig;
+  *ant = temp->sig;
 
-  while (temp != NULL) {
-    
-    if (comp(clave, temp->dato->clave) == 0) {
-      
-      *flag = 1; //si se encontro el elemento, seteamos la bandera en 1 para indicarlo
-
-      if (anterior == NULL) { //el elemento a eliminar es el primero
-        lista = temp->sig;
-      } else {
-        anterior->sig = temp->sig;  // Saltar el nodo eliminado
-      }
-
-      //bloqueamos la lru para reacomodar 
-      //punteros y removerlo de esta.
-      pthread_mutex_lock(&lockLru);
-      eliminar_lru(lru,temp);
-      pthread_mutex_unlock(&lockLru);
-
-      destr(temp->dato); //liberamos el comando
-      free(temp); //liberamos el nodo
-      return lista;
-    }
+  //bloqueamos la lru para reacomodar 
+  //punteros y removerlo de esta.
+  bloquear(&lru->lock, &lru->perfil);
+  eliminar_lru(lru,temp);
+  pthread_mutex_unlock(&lru->lock);
 
-    anterior = temp;
-    temp = temp->sig;
-  }
-  
+  invalidar_clave(temp->dato->clave); //DEL o desalojo, avisamos antes de liberar la clave
+  tabla->destroy(temp->dato); //liberamos el comando
+  liberar(temp); //liberamos el nodo
   return lista;
 }
 
@@ -234,22 +393,66 @@ int eliminar_nodo_tabla(TablaHash tabla, char* clave, ListaLru lru, int funcion)
   
   if (tabla == NULL) return 0;
   
-  int idx = tabla->hash(clave) % tabla->capacidad;
+  unsigned len;
+  unsigned hash = hash_de(tabla, clave, &len);
+  int idx = hash % tabla->capacidad;
   
   if (funcion == 1) { //se llama para el pedido DEL
-    pthread_mutex_lock(&(locks[idx % LOCKS]));
+    bloquear(&(tabla->locks[idx % LOCKS]), &(tabla->perfiles[idx % LOCKS]));
     
   } else { //se llama desde desalojo()
-    int c = pthread_mutex_trylock(&(locks[idx % LOCKS]));
+    int c = intentar_bloquear(&(tabla->locks[idx % LOCKS]), &(tabla->perfiles[idx % LOCKS]));
     if (c != 0) return -1; //la seccion se encontraba bloqueada
   }
   int flag = 0; //bandera para retornar si el elemento se encontraba o no
-  tabla->arreglo[idx] = eliminar_nodo_lista(tabla->arreglo[idx], clave, &flag,(FuncionComparadora) tabla->comp, (FuncionDestructora) tabla->destroy,lru);
-  pthread_mutex_unlock(&(locks[idx % LOCKS])); //una vez eliminado el par, soltamos el lock
+  tabla->arreglo[idx] = eliminar_nodo_lista(tabla, tabla->arreglo[idx], clave, hash, len, &flag, lru);
+  if (funcion == 1) anotar_escritura(clave, NULL); //el DEL se borra del respaldo aunque no estuviera en la cache
+  pthread_mutex_unlock(&(tabla->locks[idx % LOCKS])); //una vez eliminado el par, soltamos el lock
 
   return flag; //retornamos la bandera para indicar si pudimos eliminar
 }
 
+//desaloja el nodo de la tablahash y la lru.
+//se llama desde desalojo(), con lru->lock tomado: mientras lo tenemos el nodo
+//no se puede liberar, pero su dato si (un PUT/CAS lo reemplaza con la seccion
+//tomada), asi que la seccion se ubica con nodo->hash y el dato solo se lee
+//despues de tomarla.
+//retorna 1 si lo desalojo, -1 si la seccion estaba bloqueada.
+int desalojar_nodo(TablaHash tabla, HList* nodo, ListaLru lru) {
+  
+  int idx = nodo->hash % tabla->capacidad;
+  
+  int c = intentar_bloquear(&(tabla->locks[idx % LOCKS]), &(tabla->perfiles[idx % LOCKS]));
+  if (c != 0) return -1; //la seccion se encontraba bloqueada
+  
+  //con la seccion y la lru tomadas nadie puede estar sacandolo:
+  //si esta en la lru, esta en la lista de su casilla
+  HList** ant = &tabla->arreglo[idx];
+  while (*ant != nodo) ant = &(*ant)->sig;
+  *ant = nodo->sig;
+  
+  eliminar_lru(lru, nodo); //lru->lock es recursivo y ya lo tenemos
+  invalidar_clave(nodo->dato->clave);
+  tabla->destroy(nodo->dato);
+  liberar(nodo);
+  
+  pthread_mutex_unlock(&(tabla->locks[idx % LOCKS]));
+  return 1;
+}
+
+//retorna si el dato del nodo no fue invalidado por un FLUSH.
+//se llama con lru->lock tomado: como en desalojar_nodo, el dato solo se lee
+//con la seccion tomada. si esta bloqueada, se lo considera vigente.
+int nodo_vigente(TablaHash tabla, HList* nodo) {
+  
+  int idx = nodo->hash % tabla->capacidad;
+  
+  if (intentar_bloquear(&(tabla->locks[idx % LOCKS]), &(tabla->perfiles[idx % LOCKS])) != 0) return 1;
+  int vigente = comando_vigente(nodo->dato);
+  pthread_mutex_unlock(&(tabla->locks[idx % LOCKS]));
+  return vigente;
+}
+
 //crea la estructura que lleva la cantidad de 
 //pedidos y claves ingresadas por el cliente
 Stats crear_stats() {
@@ -258,5 +461,134 @@ Stats crear_stats() {
   st->get = 0;
   st->del = 0;
   st->keys = 0;
+  pthread_mutex_init(&st->lock, NULL);
+  iniciar_perfil(&st->perfil);
   return st;
-}
\ No newline at end of file
+}
+//bloquea la seccion de la clave y busca su nodo, registrando el acceso.
+//retorna el nodo (NULL si no esta); en ambos casos la seccion *idx % LOCKS
+//queda bloqueada y la tiene que soltar el que llama.
+static HList* bloquear_clave(TablaHash tabla, char* clave, ListaLru lru, int* idx) {
+  
+  unsigned len;
+  unsigned hash = hash_de(tabla, clave, &len);
+  *idx = hash % tabla->capacidad;
+  
+  registrar_acceso(lru->sketch, hash);
+  registrar_hot(tabla->hot, clave, hash, *idx % LOCKS);
+  
+  bloquear(&(tabla->locks[*idx % LOCKS]), &(tabla->perfiles[*idx % LOCKS]));
+  
+  HList* nodo = buscar_nodo(tabla, tabla->arreglo[*idx], clave, hash, len);
+  if (nodo != NULL && !comando_vigente(nodo->dato)) return NULL; //invalidado
+  if (nodo != NULL) marcar_activo(nodo);
+  return nodo;
+}
+
+//reemplaza el valor de la clave por el de dato, solo si su version sigue
+//siendo la que leyo el cliente con GETS (CAS "clave" "valor" version).
+//si no se reemplaza, libera dato.
+//retorna OP_OK, OP_NOENCONTRADA u OP_VERSION
+int cas_tabla(TablaHash tabla, Comando dato, unsigned long long version, ListaLru lru) {
+  
+  int idx;
+  HList* nodo = bloquear_clave(tabla, dato->clave, lru, &idx);
+  
+  int r = OP_OK;
+  if (nodo == NULL) {
+    r = OP_NOENCONTRADA;
+  } else if (nodo->dato->version != version) {
+    r = OP_VERSION;
+  } else {
+    tabla->destroy(nodo->dato);
+    nodo->dato = dato;
+    invalidar_clave(dato->clave);
+    anotar_escritura(dato->clave, dato->valor);
+  }
+  pthread_mutex_unlock(&(tabla->locks[idx % LOCKS]));
+  
+  if (r != OP_OK) tabla->destroy(dato);
+  return r;
+}
+
+//suma (o resta, si decrementar) delta al valor numerico de la clave
+//(INCR/DECR "clave" delta). la suma da la vuelta en 2^64 y la resta
+//se queda en 0, como en memcached. guarda el valor nuevo en *resultado.
+//la memoria del valor nuevo se reserva con la seccion tomada: si hay que
+//desalojar, desalojo() solo usa trylock y saltea esta seccion.
+//retorna OP_OK, OP_NOENCONTRADA u OP_NONUMERICO
+int incr_tabla(TablaHash tabla, char* clave, uint64_t delta, int decrementar, ListaLru lru, uint64_t* resultado) {
+  
+  int idx;
+  HList* nodo = bloquear_clave(tabla, clave, lru, &idx);
+  
+  if (nodo == NULL) {
+    pthread_mutex_unlock(&(tabla->locks[idx % LOCKS]));
+    return OP_NOENCONTRADA;
+  }
+  
+  //el valor tiene que ser un entero sin signo de 64 bits
+  char* valor = nodo->dato->valor;
+  char* fin;
+  errno = 0;
+  uint64_t actual = strtoull(valor, &fin, 10);
+  if (*valor < '0' || *valor > '9' || *fin != '\0' || errno == ERANGE) {
+    pthread_mutex_unlock(&(tabla->locks[idx % LOCKS]));
+    return OP_NONUMERICO;
+  }
+  
+  if (decrementar) actual = actual > delta ? actual - delta : 0;
+  else actual += delta;
+  
+  char buffer[21]; //maximo de 20 digitos + '\0'
+  int len = snprintf(buffer, sizeof(buffer), "%" PRIu64, actual);
+  
+  char* nuevo = safe_malloc(sizeof(char), len + 1, tabla, lru);
+  memcpy(nuevo, buffer, len + 1);
+  liberar(nodo->dato->valor);
+  nodo->dato->valor = nuevo;
+  nodo->dato->version = nueva_version();
+  invalidar_clave(clave);
+  anotar_escritura(clave, nuevo);
+  
+  pthread_mutex_unlock(&(tabla->locks[idx % LOCKS]));
+  
+  *resultado = actual;
+  return OP_OK;
+}
+
+//agrega valor al final (o al principio, si no alFinal) del valor
+//de la clave (APPEND/PREPEND "clave" "valor").
+//retorna OP_OK u OP_NOENCONTRADA
+int concatenar_tabla(TablaHash tabla, char* clave, char* valor, int alFinal, ListaLru lru) {
+  
+  int idx;
+  HList* nodo = bloquear_clave(tabla, clave, lru, &idx);
+  
+  if (nodo == NULL) {
+    pthread_mutex_unlock(&(tabla->locks[idx % LOCKS]));
+    return OP_NOENCONTRADA;
+  }
+  
+  size_t lenActual = strlen(nodo->dato->valor);
+  size_t lenNuevo = strlen(valor);
+  
+  //reservamos con la seccion tomada, igual que en incr_tabla
+  char* nuevo = safe_malloc(sizeof(char), lenActual + lenNuevo + 1, tabla, lru);
+  if (alFinal) {
+    memcpy(nuevo, nodo->dato->valor, lenActual);
+    memcpy(nuevo + lenActual, valor, lenNuevo + 1);
+  } else {
+    memcpy(nuevo, valor, lenNuevo);
+    memcpy(nuevo + lenNuevo, nodo->dato->valor, lenActual + 1);
+  }
+  liberar(nodo->dato->valor);
+  nodo->dato->valor = nuevo;
+  nodo->dato->version = nueva_version();
+  invalidar_clave(clave);
+  anotar_escritura(clave, nuevo);
+  
+  pthread_mutex_unlock(&(tabla->locks[idx % LOCKS]));
+  
+  return OP_OK;
+}
@@ -1,18 +1,16 @@
 #ifndef __HASH_CH_H__
 #define __HASH_CH_H__
 #include <pthread.h>
+#include <stdint.h>
+#include "tinylfu.h"
+#include "hotkeys.h"
+#include "espacios.h"
+#include "perfil_locks.h"
 
 //capacidades
 #define TH 100000
 #define LOCKS TH / 100
 
-//mutex
-extern pthread_mutexattr_t recHash;
-extern pthread_mutex_t locks[LOCKS];
-extern pthread_mutexattr_t recLru;
-extern pthread_mutex_t lockLru;
-extern pthread_mutex_t lockStats;
-
 //funciones auxiliares TH
 typedef unsigned (*FuncionHash) (void* data);
 typedef int (*FuncionComparadora) (void* data1, void* data2);
@@ -24,35 +22,83 @@ typedef struct _stats {
   long long int get;
   long long int del;
   long long int keys;
+  pthread_mutex_t lock;
+  PerfilLock perfil;
 } *Stats;
 
 //estructura que lleva los pares {clave,valor}
 typedef struct _comando {
   char* clave;
   char* valor;
+  unsigned lenClave; //largo de la clave, sin el '\0'
+  unsigned long long version; //cambia en cada modificacion del valor (CAS)
+  Espacio* espacio; //espacio de nombres de la clave (NULL si no tiene)
+  unsigned long genEspacio; //generaciones con las que se guardo
+  unsigned long genGlobal;  //(ver espacios.h)
 } *Comando;
 
+//resultados de las operaciones atomicas
+#define OP_OK 0
+#define OP_NOENCONTRADA 1 //la clave no esta
+#define OP_VERSION 2 //la version no coincide (CAS)
+#define OP_NONUMERICO 3 //el valor no es un entero sin signo (INCR/DECR)
+
+//segmentos de la lru
+#define HOT 0 //donde entran los items nuevos (ventana de admision)
+#define WARM 1 //items que se accedieron de nuevo estando en hot o cold
+#define COLD 2 //items frios, de donde se desaloja
+#define NSEGMENTOS 3
+
+//porcentaje de items que ocupa cada segmento
+//(cold se queda con el resto)
+#define PORC_HOT 2
+#define PORC_WARM 40
+
 //nodo de la tablahash/lru
 //el dato es compartido, mientras que 
 //hay un puntero al siguiente para la TH y
 //un puntero al siguiente y al anterior de la lru
 typedef struct _HList {
   Comando dato;
+  unsigned hash; //hash de la clave, no cambia mientras el nodo exista
+  int segmento; //segmento de la lru en el que se encuentra
+  int activo; //se accedio desde la ultima pasada del mantenedor
   struct _HList* prev_lru;
   struct _HList* sig_lru;
   struct _HList* sig;
 } HList;
 
 //estructura que lleva un puntero 
-//al primer y ultimo elemento de la lru
-typedef struct ListaLru {
+//al primer y ultimo elemento de un segmento de la lru
+typedef struct _segmento {
   HList* head;
   HList* tail;
+  long tam;
+} Segmento;
+
+//lru segmentada (hot/warm/cold) con admision W-TinyLFU:
+//los items nuevos entran a hot y, al desalojar, el sketch decide
+//si el candidato de hot desplaza a la victima de cold.
+//los accesos solo marcan el nodo como activo, el mantenedor
+//es el que mueve los nodos entre segmentos.
+typedef struct ListaLru {
+  Segmento seg[NSEGMENTOS];
+  Sketch sketch;
+  pthread_mutex_t lock; //recursivo, lo inicializa crear_lru()
+  PerfilLock perfil;
 } *ListaLru;
 
 //lista enlazada de la tablahash
 typedef HList* CasillaHash;
 
+//variantes de la busqueda en la tablahash, elegidas por crear_tabla.
+//con funcion_hash y compCom, el hash y la comparacion se inlinean en
+//la busqueda en lugar de llamarse por puntero; si no, se usa la generica
+#define TABLA_GENERICA 0 //hash y comparacion por puntero a funcion
+#define TABLA_LARGO 1 //compara hash, largo y bytes de la clave
+#define TABLA_CLAVE8 2 //como TABLA_LARGO, con camino rapido para claves de 8 bytes
+#define TABLA_CLAVE16 3 //idem, para claves de 16 bytes
+
 //estructura de la tablahash
 struct _tablahash {
   CasillaHash* arreglo;
@@ -60,6 +106,10 @@ struct _tablahash {
   FuncionComparadora comp;
   FuncionDestructora destroy;
   FuncionHash hash;
+  int variante; //busqueda especializada (TABLA_*)
+  HotKeys hot; //detector de claves calientes
+  pthread_mutex_t locks[LOCKS]; //cada lock protege una seccion de casillas (idx % LOCKS)
+  PerfilLock perfiles[LOCKS]; //perfil de cada seccion (-P)
 };
 typedef struct _tablahash* TablaHash;
 
@@ -76,23 +126,37 @@ void destrCom(Comando dato);
 
 int compCom(char* datoClave, char* clave);
 
+int comando_vigente(Comando dato);
+
 //FUNCIONES LISTA ENLAZADA TH
-HList* eliminar_nodo_lista(HList* lista, char* clave, int* flag, FuncionComparadora comp, FuncionDestructora destr, ListaLru Lru);
+HList* eliminar_nodo_lista(TablaHash tabla, HList* lista, char* clave, unsigned hash, unsigned len, int* flag, ListaLru Lru);
 
-char* buscar_lista(HList* lista, char* clave, FuncionComparadora comp,ListaLru lru);
+char* buscar_lista(TablaHash tabla, HList* lista, char* clave, unsigned hash, unsigned len, unsigned long long* version);
 
-HList* agregar_lista(HList* lista, Comando dato, ListaLru lru, TablaHash tabla, Stats st);
+HList* agregar_lista(HList* lista, Comando dato, HList* nuevoNodo, ListaLru lru, TablaHash tabla, Stats st);
 
 //FUNCIONES TABLAHASH
-TablaHash crear_tabla (unsigned capacidad, FuncionHash hash, FuncionComparadora comp, FuncionDestructora destroy);
+TablaHash crear_tabla (unsigned capacidad, FuncionHash hash, FuncionComparadora comp, FuncionDestructora destroy, unsigned largoClave);
 
-char *buscar_tabla(TablaHash tabla, char* clave, ListaLru lru);
+char *buscar_tabla(TablaHash tabla, char* clave, ListaLru lru, unsigned long long* version);
 
 void destruir_tabla (TablaHash tabla);
 
 void insertar_tabla(TablaHash tabla, Comando dato, ListaLru lru, Stats st);
 
+int insertar_si_falta(TablaHash tabla, Comando dato, ListaLru lru, Stats st, int (*limpia)(char* clave));
+
 int eliminar_nodo_tabla(TablaHash tabla, char* clave, ListaLru lru, int funcion);
 
+int desalojar_nodo(TablaHash tabla, HList* nodo, ListaLru lru);
+
+int nodo_vigente(TablaHash tabla, HList* nodo);
+
+int cas_tabla(TablaHash tabla, Comando dato, unsigned long long version, ListaLru lru);
+
+int incr_tabla(TablaHash tabla, char* clave, uint64_t delta, int decrementar, ListaLru lru, uint64_t* resultado);
+
+int concatenar_tabla(TablaHash tabla, char* clave, char* valor, int alFinal, ListaLru lru);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "hotkeys.h"
+
+//contador de accesos de cada thread, para muestrear sin locks
+static __thread unsigned accesos = 0;
+
+//tiempo actual en segundos (reloj monotonico)
+static double ahora() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//crea el detector vacio
+HotKeys crear_hotkeys() {
+  HotKeys hk = malloc(sizeof(struct _hotkeys));
+  hk->usadas = 0;
+  hk->inicio = ahora();
+  pthread_mutex_init(&hk->lock, 0);
+  return hk;
+}
+
+//si paso la ventana, reduce las cuentas a la mitad y corre el inicio,
+//asi las tasas reflejan el trafico reciente sin perder las claves.
+//se llama con el lock tomado
+static void decaer(HotKeys hk, double t) {
+  if (t - hk->inicio < HOT_VENTANA) return;
+  for (int i = 0; i < hk->usadas; i++) {
+    hk->entradas[i].cuenta /= 2;
+    hk->entradas[i].error /= 2;
+  }
+  hk->inicio = t - HOT_VENTANA / 2.0;
+}
+
+//registra un acceso a la clave (GET o PUT).
+//solo 1 de cada HOT_MUESTREO accesos toma el lock del detector.
+//algoritmo space-saving: si la clave no esta monitoreada
+//reemplaza a la de menor cuenta, heredando su cuenta como error.
+void registrar_hot(HotKeys hk, char* clave, unsigned hash, int stripe) {
+  
+  if (++accesos % HOT_MUESTREO != 0) return;
+  
+  pthread_mutex_lock(&hk->lock);
+  
+  decaer(hk, ahora());
+  
+  int min = 0;
+  for (int i = 0; i < hk->usadas; i++) {
+    EntradaHot* e = &hk->entradas[i];
+    if (e->hash == hash && strncmp(e->clave, clave, HOT_MAX_CLAVE - 1) == 0) {
+      e->cuenta += 1;
+      pthread_mutex_unlock(&hk->lock);
+      return;
+    }
+    if (e->cuenta < hk->entradas[min].cuenta) min = i;
+  }
+  
+  EntradaHot* e;
+  if (hk->usadas < HOT_MONITOREADAS) { //todavia hay lugar
+    e = &hk->entradas[hk->usadas++];
+    e->cuenta = 1;
+    e->error = 0;
+  } else { //reemplazamos a la de menor cuenta
+    e = &hk->entradas[min];
+    e->error = e->cuenta;
+    e->cuenta += 1;
+  }
+  strncpy(e->clave, clave, HOT_MAX_CLAVE - 1);
+  e->clave[HOT_MAX_CLAVE - 1] = '\0';
+  e->hash = hash;
+  e->stripe = stripe;
+  
+  pthread_mutex_unlock(&hk->lock);
+}
+
+//compara entradas por cuenta, de mayor a menor (para qsort)
+static int comp_entradas(const void* a, const void* b) {
+  long long ca = ((EntradaHot*)a)->cuenta;
+  long long cb = ((EntradaHot*)b)->cuenta;
+  return (ca < cb) - (ca > cb);
+}
+
+//escribe en buf las HOT_TOPK claves mas accedidas, una por linea, con su
+//tasa estimada (accesos por segundo) y el stripe que las protege.
+//retorna la cantidad de bytes escritos.
+int reporte_hot(HotKeys hk, char* buf, int tam) {
+  
+  EntradaHot copia[HOT_MONITOREADAS];
+  
+  //copiamos las entradas para no retener el lock mientras ordenamos
+  pthread_mutex_lock(&hk->lock);
+  double t = ahora();
+  decaer(hk, t);
+  int usadas = hk->usadas;
+  double transcurrido = t - hk->inicio;
+  memcpy(copia, hk->entradas, usadas * sizeof(EntradaHot));
+  pthread_mutex_unlock(&hk->lock);
+  
+  if (transcurrido < 1) transcurrido = 1;
+  qsort(copia, usadas, sizeof(EntradaHot), comp_entradas);
+  
+  int len = 0;
+  for (int i = 0; i < usadas && i < HOT_TOPK && len < tam; i++) {
+    double tasa = (double)copia[i].cuenta * HOT_MUESTREO / transcurrido;
+    double cota = (double)(copia[i].cuenta - copia[i].error) * HOT_MUESTREO / transcurrido;
+    int n = snprintf(buf + len, tam - len, "KEY=%s RATE=%.1f MINRATE=%.1f STRIPE=%d\n",
+                     copia[i].clave, tasa, cota, copia[i].stripe);
+    if (n < 0) break;
+    len += n;
+  }
+  if (len >= tam) len = tam - 1; //la salida se trunco
+  
+  return len;
+}
+
+//libera el detector
+void destruir_hotkeys(HotKeys hk) {
+  pthread_mutex_destroy(&hk->lock);
+  free(hk);
+}
@@ -0,0 +1,38 @@
+#ifndef __HOTKEYS_H__
+#define __HOTKEYS_H__
+#include <pthread.h>
+
+//parametros del detector de claves calientes (space-saving muestreado)
+#define HOT_MUESTREO 16 //se registra 1 de cada HOT_MUESTREO accesos por thread
+#define HOT_MONITOREADAS 64 //claves monitoreadas a la vez
+#define HOT_TOPK 10 //claves que se reportan
+#define HOT_MAX_CLAVE 64 //largo maximo guardado de la clave (se trunca)
+#define HOT_VENTANA 60 //segundos tras los cuales las cuentas se reducen a la mitad
+
+//clave monitoreada
+typedef struct _entradaHot {
+  char clave[HOT_MAX_CLAVE];
+  unsigned hash;
+  int stripe; //indice en tabla->locks[LOCKS]
+  long long cuenta; //cota superior de accesos muestreados
+  long long error; //sobreestimacion heredada al reemplazar otra clave
+} EntradaHot;
+
+//estructura del detector
+typedef struct _hotkeys {
+  EntradaHot entradas[HOT_MONITOREADAS];
+  int usadas;
+  double inicio; //comienzo de la ventana de medicion (segundos)
+  pthread_mutex_t lock;
+} *HotKeys;
+
+//FUNCIONES HOTKEYS
+HotKeys crear_hotkeys();
+
+void registrar_hot(HotKeys hk, char* clave, unsigned hash, int stripe);
+
+int reporte_hot(HotKeys hk, char* buf, int tam);
+
+void destruir_hotkeys(HotKeys hk);
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "latencia.h"
+#include "protocolo.h"
+
+//histogramas de todos los threads (solo se agregan)
+static Latencias* registro = NULL;
+
+//cuentas al momento del ultimo reinicio, se restan en los reportes.
+//asi reiniciar no tiene que escribir en los histogramas de otros threads
+static Latencias base;
+
+//protege el registro y base
+static pthread_mutex_t lockLatencias = PTHREAD_MUTEX_INITIALIZER;
+
+//histogramas del thread actual
+static __thread Latencias* propias = NULL;
+
+//para marcar los histogramas como libres cuando termina el thread
+static pthread_key_t claveThread;
+static pthread_once_t unaVez = PTHREAD_ONCE_INIT;
+
+//nombres de los comandos en el reporte
+static const char* nombres[LAT_OPCODES] = {
+  [PUT] = "PUT", [DEL] = "DEL", [GET] = "GET", [CAS] = "CAS", [INCR] = "INCR",
+  [DECR] = "DECR", [APPEND] = "APPEND", [PREPEND] = "PREPEND", [GETS] = "GETS",
+  [STATS] = "STATS", [HOTKEYS] = "HOTKEYS", [FLUSH_NS] = "FLUSH_NS",
+  [FLUSH_ALL] = "FLUSH_ALL", [LOCKSTATS] = "LOCKSTATS", [LATENCY] = "LATENCY",
+  [LATENCY_RESET] = "LATENCY_RESET", [TRACK] = "TRACK",
+  [LOCKSTATS_RESET] = "LOCKSTATS_RESET",
+};
+
+//tiempo actual en nanosegundos (reloj monotonico)
+unsigned long long reloj_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//bucket en el que cae un valor
+static int bucket(unsigned long long ns) {
+  if (ns < LAT_SUB) return ns; //los valores chicos son exactos
+  int exp = 63 - __builtin_clzll(ns);
+  int sub = (ns >> (exp - LAT_SUBBITS)) & (LAT_SUB - 1);
+  int b = (exp - LAT_SUBBITS + 1) * LAT_SUB + sub;
+  return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+//menor valor que cae en el bucket b
+static unsigned long long valor_bucket(int b) {
+  if (b < LAT_SUB) return b;
+  int exp = b / LAT_SUB - 1 + LAT_SUBBITS;
+  int sub = b % LAT_SUB;
+  return (1ULL << exp) + ((unsigned long long)sub << (exp - LAT_SUBBITS));
+}
+
+//al terminar un thread, sus histogramas quedan para el proximo
+//(las cuentas se conservan)
+static void liberar_propias(void* lat) {
+  __atomic_store_n(&((Latencias*)lat)->libre, 1, __ATOMIC_RELEASE);
+}
+
+static void crear_clave() {
+  pthread_key_create(&claveThread, liberar_propias);
+}
+
+//retorna los histogramas del thread, tomando unos libres o creandolos
+static Latencias* latencias_propias() {
+  
+  if (propias != NULL) return propias;
+  
+  pthread_once(&unaVez, crear_clave);
+  
+  pthread_mutex_lock(&lockLatencias);
+  for (Latencias* l = registro; l != NULL; l = l->sig) {
+    if (__atomic_load_n(&l->libre, __ATOMIC_ACQUIRE)) {
+      l->libre = 0;
+      propias = l;
+      break;
+    }
+  }
+  if (propias == NULL) {
+    propias = calloc(1, sizeof(Latencias));
+    if (propias != NULL) {
+      propias->sig = registro;
+      registro = propias;
+    }
+  }
+  pthread_mutex_unlock(&lockLatencias);
+  
+  if (propias != NULL) pthread_setspecific(claveThread, propias);
+  return propias;
+}
+
+//registra la latencia de un pedido, desde que se termino de leer
+//(inicio, con reloj_ns) hasta ahora, que ya se escribio la respuesta
+void registrar_latencia(int comando, int acierto, unsigned long long inicio) {
+  
+  if (comando < 0 || comando >= LAT_OPCODES) return;
+  
+  Latencias* lat = latencias_propias();
+  if (lat == NULL) return;
+  
+  unsigned long* cuenta = &lat->h[comando][acierto ? 0 : 1].cuentas[bucket(reloj_ns() - inicio)];
+  
+  //este thread es el unico que escribe, no hace falta un incremento atomico
+  __atomic_store_n(cuenta, __atomic_load_n(cuenta, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+//suma los histogramas de todos los threads para el comando/acierto,
+//menos las cuentas del ultimo reinicio. se llama con lockLatencias tomado.
+//retorna la cantidad total.
+static unsigned long sumar(int comando, int fallo, Histograma* total) {
+  
+  unsigned long n = 0;
+  for (int b = 0; b < LAT_BUCKETS; b++) {
+    unsigned long c = 0;
+    for (Latencias* l = registro; l != NULL; l = l->sig) {
+      c += __atomic_load_n(&l->h[comando][fallo].cuentas[b], __ATOMIC_RELAXED);
+    }
+    c -= base.h[comando][fallo].cuentas[b];
+    total->cuentas[b] = c;
+    n += c;
+  }
+  return n;
+}
+
+//valor (en microsegundos) por debajo del cual queda la fraccion q de las muestras
+static double percentil(Histograma* h, unsigned long n, double q) {
+  
+  unsigned long objetivo = (unsigned long)(q * n);
+  if (objetivo >= n) objetivo = n - 1;
+  
+  unsigned long acumulado = 0;
+  int b;
+  for (b = 0; b < LAT_BUCKETS - 1; b++) {
+    acumulado += h->cuentas[b];
+    if (acumulado > objetivo) break;
+  }
+  return (valor_bucket(b + 1) - 1) / 1000.0; //el mayor valor del bucket
+}
+
+//reporte de las latencias (LATENCY): una linea por comando y
+//acierto/fallo que tenga muestras, con sus percentiles.
+//retorna la cantidad de bytes escritos en buf.
+int reporte_latencias(char* buf, int tam) {
+  
+  static Histograma total; //protegido por lockLatencias
+  int len = 0;
+  
+  pthread_mutex_lock(&lockLatencias);
+  for (int op = 0; op < LAT_OPCODES && len < tam; op++) {
+    for (int fallo = 0; fallo < 2 && len < tam; fallo++) {
+      
+      unsigned long n = sumar(op, fallo, &total);
+      if (n == 0) continue;
+      
+      char nombre[16];
+      if (nombres[op] != NULL) snprintf(nombre, sizeof(nombre), "%s", nombres[op]);
+      else snprintf(nombre, sizeof(nombre), "%d", op);
+      
+      int maximo;
+      for (maximo = LAT_BUCKETS - 1; maximo > 0 && total.cuentas[maximo] == 0; maximo--);
+      
+      int r = snprintf(buf + len, tam - len,
+                       "OP=%s %s COUNT=%lu P50_US=%.1f P90_US=%.1f P99_US=%.1f P999_US=%.1f MAX_US=%.1f\n",
+                       nombre, fallo ? "MISS" : "HIT", n,
+                       percentil(&total, n, 0.5), percentil(&total, n, 0.9),
+                       percentil(&total, n, 0.99), percentil(&total, n, 0.999),
+                       (valor_bucket(maximo + 1) - 1) / 1000.0);
+      if (r < 0) break;
+      len += r;
+    }
+  }
+  pthread_mutex_unlock(&lockLatencias);
+  
+  if (len >= tam) len = tam - 1; //la salida se trunco
+  return len;
+}
+
+//pone los histogramas en 0 (LATENCY_RESET): guarda las cuentas
+//actuales como base, que se restan en los reportes siguientes
+void reiniciar_latencias() {
+  
+  pthread_mutex_lock(&lockLatencias);
+  for (int op = 0; op < LAT_OPCODES; op++) {
+    for (int fallo = 0; fallo < 2; fallo++) {
+      for (int b = 0; b < LAT_BUCKETS; b++) {
+        unsigned long c = 0;
+        for (Latencias* l = registro; l != NULL; l = l->sig) {
+          c += __atomic_load_n(&l->h[op][fallo].cuentas[b], __ATOMIC_RELAXED);
+        }
+        base.h[op][fallo].cuentas[b] = c;
+      }
+    }
+  }
+  pthread_mutex_unlock(&lockLatencias);
+}
@@ -0,0 +1,37 @@
+#ifndef __LATENCIA_H__
+#define __LATENCIA_H__
+
+//histogramas de latencia por comando (estilo HdrHistogram).
+//cada thread tiene los suyos y es el unico que los escribe, asi registrar
+//una latencia no toma locks. los reportes suman los de todos los threads.
+//los buckets son log-lineales: cada potencia de 2 se divide en LAT_SUB
+//partes iguales, con un error relativo de a lo sumo 1/LAT_SUB.
+
+#define LAT_SUBBITS 3
+#define LAT_SUB (1 << LAT_SUBBITS)
+#define LAT_BUCKETS (40 * LAT_SUB) //hasta 2^41 ns (~36 minutos)
+#define LAT_OPCODES 32 //los codigos de comando son menores a 32
+
+//histograma de un comando (aciertos o fallos)
+typedef struct _histograma {
+  unsigned long cuentas[LAT_BUCKETS];
+} Histograma;
+
+//histogramas de un thread, por comando y por acierto/fallo
+//(fallo: la respuesta no fue OK ni OKE, por ejemplo ENOTFOUND)
+typedef struct _latencias {
+  Histograma h[LAT_OPCODES][2];
+  int libre; //el thread termino, otro puede reusarlos
+  struct _latencias* sig;
+} Latencias;
+
+//FUNCIONES LATENCIA
+unsigned long long reloj_ns();
+
+void registrar_latencia(int comando, int acierto, unsigned long long inicio);
+
+int reporte_latencias(char* buf, int tam);
+
+void reiniciar_latencias();
+
+#endif
@@ -2,35 +2,177 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include "lru.h"
 #include "hash_chaining.h"
+#include "seguimiento.h"
+
+
+//limite de memoria de los items y marcas del recolector (0 = sin limite)
+static size_t limiteMemoria = 0;
+static size_t marcaAlta = 0;
+static size_t marcaBaja = 0;
+
+//para despertar al recolector
+static pthread_mutex_t lockRecolector = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t condRecolector = PTHREAD_COND_INITIALIZER;
+static int recolectorActivo = 0;
+
+
+//despierta al recolector si no esta trabajando
+static void despertar_recolector() {
+  if (!__atomic_load_n(&recolectorActivo, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&lockRecolector);
+    pthread_cond_signal(&condRecolector);
+    pthread_mutex_unlock(&lockRecolector);
+  }
+}
 
 
 //funcion de testeo que imprime la lru
 void imprimir_lru(ListaLru lru) {
-  printf("-----LRU-----\n");
-  for(HList* nodo = lru->head; nodo != NULL; nodo = nodo->sig_lru){
-    printf("Clave: %s, Valor: %s\n", nodo->dato->clave, nodo->dato->valor);
+  const char* nombres[NSEGMENTOS] = {"HOT", "WARM", "COLD"};
+  for (int i = 0; i < NSEGMENTOS; i++) {
+    printf("-----%s-----\n", nombres[i]);
+    for(HList* nodo = lru->seg[i].head; nodo != NULL; nodo = nodo->sig_lru){
+      printf("Clave: %s, Valor: %s\n", nodo->dato->clave, nodo->dato->valor);
+    }
   }
   printf("-----FIN LRU-----\n");
 }
 
 
+//agrega el nodo al inicio del segmento
+static void agregar_segmento(Segmento* seg, HList* nodo) {
+  
+  nodo->prev_lru = NULL;
+  nodo->sig_lru = seg->head;
+  
+  if (seg->head == NULL) { //segmento vacio
+    seg->tail = nodo;
+  } else {
+    seg->head->prev_lru = nodo;
+  }
+  seg->head = nodo;
+  seg->tam += 1;
+}
+
+
+//quita el nodo del segmento
+//no libera memoria, solo reacomoda punteros
+static void quitar_segmento(Segmento* seg, HList* nodo) {
+  
+  if (nodo->prev_lru != NULL) {
+    nodo->prev_lru->sig_lru = nodo->sig_lru;
+  } else { //caso primer elem
+    seg->head = nodo->sig_lru;
+  }
+  
+  if (nodo->sig_lru != NULL) {
+    nodo->sig_lru->prev_lru = nodo->prev_lru;
+  } else { //caso ult elem
+    seg->tail = nodo->prev_lru;
+  }
+  
+  nodo->prev_lru = NULL;
+  nodo->sig_lru = NULL;
+  seg->tam -= 1;
+}
+
+
+//mueve el nodo al inicio del segmento destino
+//se llama con lru->lock tomado
+static void mover_segmento(ListaLru lru, HList* nodo, int destino) {
+  quitar_segmento(&lru->seg[nodo->segmento], nodo);
+  nodo->segmento = destino;
+  agregar_segmento(&lru->seg[destino], nodo);
+}
+
+
+//mueve el nodo al final de cold (es el proximo desalojado)
+//se llama con lru->lock tomado
+static void mover_cola_cold(ListaLru lru, HList* nodo) {
+  
+  Segmento* cold = &lru->seg[COLD];
+  quitar_segmento(&lru->seg[nodo->segmento], nodo);
+  nodo->segmento = COLD;
+  
+  nodo->sig_lru = NULL;
+  nodo->prev_lru = cold->tail;
+  if (cold->tail == NULL) { //segmento vacio
+    cold->head = nodo;
+  } else {
+    cold->tail->sig_lru = nodo;
+  }
+  cold->tail = nodo;
+  cold->tam += 1;
+}
+
+
+//retorna 1 si no hay ningun elemento en la lru
+int lru_vacia(ListaLru lru) {
+  if (lru == NULL) return 1;
+  for (int i = 0; i < NSEGMENTOS; i++) {
+    if (lru->seg[i].head != NULL) return 0;
+  }
+  return 1;
+}
+
+
+//marca el nodo como accedido.
+//no toma el lock de la lru, se llama con la seccion de la tablahash
+//bloqueada, lo que garantiza que el nodo no se libere mientras tanto
+void marcar_activo(HList* nodo) {
+  if (!__atomic_load_n(&nodo->activo, __ATOMIC_RELAXED))
+    __atomic_store_n(&nodo->activo, 1, __ATOMIC_RELAXED);
+}
+
+
+//consume la marca de activo del nodo, retorna si estaba marcado
+static int tomar_activo(HList* nodo) {
+  return __atomic_exchange_n(&nodo->activo, 0, __ATOMIC_RELAXED);
+}
+
+
 //funcion que chequea si el programa sigue teniendo memoria suficiente.
 //explicacion detallada en el informe.
+//la memoria sale de la cache del thread (ver cache_alloc.c), por lo que
+//debe liberarse con liberar() y no con free().
+//el desalojo normalmente lo hace el recolector: aca solo se desaloja si la
+//memoria en uso supera el limite (ultimo recurso) o si malloc falla.
+//si la lru esta vacia lo sabemos por desalojo(), que la revisa con el lock
+//tomado: aca no se puede leer sin el lock.
+//la memoria libre de las caches cuenta como usada, por eso despues de
+//desalojar se vacia la cache: si no, memoria_en_uso() no baja.
 void* safe_malloc(size_t size_type, int size, TablaHash tabla, ListaLru lru) {
   
-  void* dato = malloc(size_type * size);
+  size_t tam = size_type * size;
+  
+  if (limiteMemoria > 0) {
+    size_t usada = memoria_en_uso();
+    if (usada > marcaAlta) despertar_recolector();
+    while (usada + tam > limiteMemoria) {
+      if (desalojo(tabla, lru) <= 0) break;
+      vaciar_cache_local();
+      usada = memoria_en_uso();
+    }
+  }
+  
+  void* dato = reservar(tam);
+  
+  if (dato == NULL) { //antes de desalojar devolvemos la memoria libre de la cache
+    vaciar_cache_local();
+    dato = reservar(tam);
+  }
   
   while (dato == NULL) { //mientras que no haya memoria disponible,
     
-    if (lru->head == NULL) {
+    if (desalojo(tabla, lru) < 0) { //liberamos memoria
       fprintf(stderr, "Error: Memoria insuficiente y LRU vacía.\n");
       exit(EXIT_FAILURE);
     }
-
-    desalojo(tabla, lru); //liberamos memoria
-    dato = malloc(size_type * size);
+    vaciar_cache_local(); //y la devolvemos al pool, para que se junte con su buddy
+    dato = reservar(tam);
   
   }
   
@@ -38,54 +180,189 @@ void* safe_malloc(size_t size_type, int size, TablaHash tabla, ListaLru lru) {
 }
 
 
-//se encarga de liberar memoria del programa para poder reservar nueva.
-//explicacion detallada en el informe.
-void desalojo(TablaHash tabla, ListaLru lru) {
+//intenta desalojar un elemento del segmento, empezando por el menos usado.
+//si respetarActivos es 1, saltea los nodos accedidos que el mantenedor
+//todavia no promovio.
+//retorna 1 si pudo, 0 si no encontro ningun nodo desalojable.
+//se llama con lru->lock tomado.
+static int desalojar_segmento(TablaHash tabla, ListaLru lru, int seg, int respetarActivos) {
   
-  pthread_mutex_lock(&lockLru);
-
-  if (lru == NULL || lru->tail == NULL) {
-    printf("Error: Intento de remover un nodo de una LRU vacía.\n");
-    pthread_mutex_unlock(&lockLru);
-    return;
-  }
-
-  HList* nodo = lru->tail;
+  HList* nodo = lru->seg[seg].tail;
   int flag;
 
   while (nodo) {
 
-    flag = eliminar_nodo_tabla(tabla, nodo->dato->clave, lru, 0); //intentamos eliminar el nodo
+    if (respetarActivos && __atomic_load_n(&nodo->activo, __ATOMIC_RELAXED)) {
+      nodo = nodo->prev_lru;
+      continue;
+    }
+    
+    flag = desalojar_nodo(tabla, nodo, lru); //intentamos eliminar el nodo
     if (flag == -1) { //no pudimos tomar el lock
       nodo = nodo->prev_lru; //intentamos con el anterior (vamos del menos usado al mas)
     } else { //se logro eliminar
-      pthread_mutex_unlock(&lockLru); //soltamos lock
-      return;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+//desaloja un elemento eligiendo la victima con la politica W-TinyLFU.
+//retorna 1 si pudo desalojar, 0 si no.
+//se llama con lru->lock tomado.
+static int desalojar_uno(TablaHash tabla, ListaLru lru) {
+  
+  if (lru_vacia(lru)) return 0;
+
+  HList* candidato = lru->seg[HOT].tail;
+  HList* victima = lru->seg[COLD].tail ? lru->seg[COLD].tail : lru->seg[WARM].tail;
+  int admitir;
+
+  //el dato de los nodos solo se puede leer con su seccion tomada (ver desalojar_nodo)
+  if (candidato != NULL && !nodo_vigente(tabla, candidato)) {
+    admitir = 0; //invalidado por un FLUSH, se desaloja primero
+  } else if (victima != NULL && !nodo_vigente(tabla, victima)) {
+    admitir = 1;
+  } else if (candidato != NULL && victima != NULL) {
+    unsigned fc = estimar_frecuencia(lru->sketch, candidato->hash);
+    unsigned fv = estimar_frecuencia(lru->sketch, victima->hash);
+    admitir = fc > fv;
+  } else {
+    admitir = (candidato == NULL); //no hay nada en hot
+  }
+
+  //orden en el que se intenta desalojar de cada segmento
+  int orden[NSEGMENTOS];
+  if (admitir) {
+    orden[0] = COLD; orden[1] = WARM; orden[2] = HOT;
+  } else {
+    orden[0] = HOT; orden[1] = COLD; orden[2] = WARM;
+  }
+
+  //primero respetando los nodos activos y, si no alcanza, sin respetarlos
+  for (int respetar = 1; respetar >= 0; respetar--) {
+    for (int i = 0; i < NSEGMENTOS; i++) {
+      if (desalojar_segmento(tabla, lru, orden[i], respetar)) {
+        if (admitir && candidato != NULL && orden[i] != HOT) {
+          //el candidato fue admitido, pasa a cold
+          mover_segmento(lru, candidato, COLD);
+        }
+        return 1;
+      }
     }
   }
   
-  //nodo es NULL
-  printf("Error: No se pudo remover ningún nodo de la LRU.\n");
-  pthread_mutex_unlock(&lockLru); //soltamos el lock
+  return 0;
 }
 
 
-//agregamos un elemento a la lru
-//recibe el nodo que fue agregado a la tablahash y
-//reacomoda puntero para formar la lru
-void agregar_lru(ListaLru lru, HList* nodo) {
+//se encarga de liberar memoria del programa para poder reservar nueva.
+//explicacion detallada en el informe.
+//politica W-TinyLFU: el candidato (cola de hot) solo desplaza a la
+//victima (cola de cold, o de warm si cold esta vacio) si el sketch estima
+//que es mas frecuente. si no, el desalojado es el propio candidato.
+//asi un recorrido de claves que se usan una sola vez no vacia la lru.
+//retorna 1 si pudo desalojar, 0 si no pudo y -1 si la lru esta vacia.
+int desalojo(TablaHash tabla, ListaLru lru) {
   
-  if (lru->head == NULL) {
-    nodo->sig_lru = NULL;
-    nodo->prev_lru = NULL;
-    lru->head = nodo;
-    lru->tail = nodo;
-    return;
+  if (lru == NULL) return -1;
+  bloquear(&lru->lock, &lru->perfil);
+
+  if (lru_vacia(lru)) {
+    pthread_mutex_unlock(&lru->lock);
+    return -1;
+  }
+
+  int desalojado = desalojar_uno(tabla, lru);
+  if (!desalojado) {
+    //no se pudo desalojar de ningun segmento
+    printf("Error: No se pudo remover ningún nodo de la LRU.\n");
+  }
+  
+  pthread_mutex_unlock(&lru->lock); //soltamos el lock
+  return desalojado;
+}
+
+
+//desaloja hasta n elementos tomando lru->lock una sola vez.
+//retorna la cantidad desalojada.
+int desalojo_lote(TablaHash tabla, ListaLru lru, int n) {
+  
+  int desalojados = 0;
+  
+  bloquear(&lru->lock, &lru->perfil);
+  while (desalojados < n && desalojar_uno(tabla, lru)) {
+    desalojados++;
+  }
+  pthread_mutex_unlock(&lru->lock);
+  
+  return desalojados;
+}
+
+
+//configura el limite de memoria de los items y sus marcas
+void configurar_memoria(size_t limite) {
+  limiteMemoria = limite;
+  marcaAlta = limite / 100 * MARCA_ALTA;
+  marcaBaja = limite / 100 * MARCA_BAJA;
+}
+
+
+//thread recolector.
+//mantiene la memoria en uso por debajo de la marca baja, desalojando de a
+//LOTE_DESALOJO elementos, para que los pedidos no tengan que desalojar.
+//se despierta cuando algun pedido supera la marca alta, o cada
+//INTERVALO_RECOLECTOR microsegundos.
+//con varias particiones desaloja un lote de cada una por turno.
+void* recolector(void* args) {
+  
+  RecolectorArgs r = (RecolectorArgs)args;
+  int turno = 0;
+  
+  for (;;) {
+    pthread_mutex_lock(&lockRecolector);
+    while (memoria_en_uso() <= marcaAlta) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += INTERVALO_RECOLECTOR * 1000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&condRecolector, &lockRecolector, &ts);
+    }
+    pthread_mutex_unlock(&lockRecolector);
+    
+    __atomic_store_n(&recolectorActivo, 1, __ATOMIC_RELAXED);
+    int vacias = 0; //particiones seguidas sin nada desalojable
+    while (memoria_en_uso() > marcaBaja) {
+      int i = turno++ % r->cantidad;
+      int desalojados = desalojo_lote(r->tablas[i], r->lrus[i], LOTE_DESALOJO);
+      enviar_avisos(); //invalidaciones de los desalojados (TRACK), ya sin la lru tomada
+      vaciar_cache_local(); //lo desalojado vuelve al pool, y asi deja de contar como usado
+      if (desalojados > 0) {
+        vacias = 0;
+      } else if (++vacias >= r->cantidad) {
+        usleep(INTERVALO_RECOLECTOR); //no hay nada desalojable por ahora
+        break;
+      }
+    }
+    __atomic_store_n(&recolectorActivo, 0, __ATOMIC_RELAXED);
   }
+  
+  return NULL;
+}
 
-  nodo->sig_lru = lru->head;
-  lru->head->prev_lru = nodo;
-  lru->head = nodo;
+
+//agregamos un elemento a la lru
+//recibe el nodo que fue agregado a la tablahash y lo pone al inicio de hot.
+//el mantenedor se encarga de pasarlo a warm o cold.
+void agregar_lru(ListaLru lru, HList* nodo) {
+  
+  nodo->segmento = HOT;
+  nodo->activo = 0;
+  agregar_segmento(&lru->seg[HOT], nodo);
   
   return;
 }
@@ -97,75 +374,132 @@ void agregar_lru(ListaLru lru, HList* nodo) {
 void eliminar_lru(ListaLru lru, HList* nodo) {
   
   //caso lru vacia
-  if (lru == NULL) return;
-  //caso un solo elem
-  if (lru->head == lru->tail) {
-    lru->head = NULL;
-    lru->tail = NULL;
-    return;
-  }
-  //caso primer elem
-  if (lru->head == nodo) {
-    lru->head = lru->head->sig_lru;
-    lru->head->prev_lru = NULL;
-    return;
-  }
-  //caso ult elem
-  if (lru->tail == nodo) {
-    lru->tail = lru->tail->prev_lru;
-    lru->tail->sig_lru = NULL;
-  } else {
-    //caso elem del diome
-    HList* temp2 = nodo->sig_lru;
-    nodo->prev_lru->sig_lru = temp2;
-    nodo->sig_lru->prev_lru = nodo->prev_lru;
-  }
+  if (lru_vacia(lru)) return;
+  
+  quitar_segmento(&lru->seg[nodo->segmento], nodo);
   
   return;
 }
 
 
-//mueve un elemento que ya se encuentra en la lru al inicio de esta, 
+//mueve un elemento que ya se encuentra en la lru al inicio de su segmento, 
 //ya que pasa a ser el "mas recientemente usado".
-//se usa cuando un cliente hizo un pedido con una clave ya existente
-//o cuando se busca un valor asociado a una clave.
+//lo usa el mantenedor, los pedidos solo marcan el nodo como activo.
 void modificar_lru(ListaLru lru, HList* nodo) {
 
   //caso lista vacia
-  if (lru == NULL || lru->head == NULL) {
+  if (lru_vacia(lru)) {
     printf("Error: Intento de modificar una LRU vacía.\n");
     return;
   }
-  //caso un solo elem
-  if (lru->head == lru->tail) return;
+  
+  Segmento* seg = &lru->seg[nodo->segmento];
   //caso primer elem
-  if (lru->head == nodo) return;
+  if (seg->head == nodo) return;
 
-  //caso ult elem
-  if (lru->tail == nodo) {
-    nodo->prev_lru->sig_lru = NULL;
-    lru->tail = nodo->prev_lru;
-  } else {
-    //caso elem del diome
-    HList* nodo2 = nodo->sig_lru;
-    nodo->prev_lru->sig_lru = nodo2;
-    nodo->sig_lru->prev_lru = nodo->prev_lru;
+  quitar_segmento(seg, nodo);
+  agregar_segmento(seg, nodo);
+  
+  return;
+}
+
+
+//una pasada del mantenedor: reacomoda los segmentos segun los
+//nodos activos y los tamaños objetivo de hot y warm.
+//- de cold, los nodos activos de la cola suben a warm
+//- hot excedido: su cola pasa por la admision de W-TinyLFU, como en
+//  desalojar_uno. si el sketch la estima mas frecuente que la victima, pasa a
+//  warm si fue accedida o a cold si no. si no, va al final de cold y es la
+//  proxima desalojada, en lugar de la victima
+//- warm excedido: su cola vuelve al inicio de warm si fue accedida, si no baja a cold
+//mueve a lo sumo MOVIMIENTOS_MANTENEDOR nodos para no retener el lock.
+//retorna la cantidad de nodos movidos.
+int mantener_lru(ListaLru lru) {
+  
+  int movidos = 0;
+  
+  bloquear(&lru->lock, &lru->perfil);
+  
+  long total = lru->seg[HOT].tam + lru->seg[WARM].tam + lru->seg[COLD].tam;
+  long objHot = total * PORC_HOT / 100;
+  long objWarm = total * PORC_WARM / 100;
+  if (objHot < 1) objHot = 1;
+  
+  //promovemos los nodos activos de la cola de cold
+  HList* nodo = lru->seg[COLD].tail;
+  for (int i = 0; nodo != NULL && i < MOVIMIENTOS_MANTENEDOR; i++) {
+    HList* anterior = nodo->prev_lru;
+    if (tomar_activo(nodo)) {
+      mover_segmento(lru, nodo, WARM);
+      movidos++;
+    }
+    nodo = anterior;
   }
   
-  HList* inicio = lru->head;
-  nodo->sig_lru = inicio;
-  lru->head->prev_lru = nodo;
-  lru->head = nodo;
-  lru->head->prev_lru = NULL;
+  //hot excedido
+  while (lru->seg[HOT].tam > objHot && movidos < MOVIMIENTOS_MANTENEDOR) {
+    nodo = lru->seg[HOT].tail;
+    HList* victima = lru->seg[COLD].tail ? lru->seg[COLD].tail : lru->seg[WARM].tail;
+    int activo = tomar_activo(nodo);
+    if (victima == NULL || estimar_frecuencia(lru->sketch, nodo->hash) > estimar_frecuencia(lru->sketch, victima->hash)) {
+      mover_segmento(lru, nodo, activo ? WARM : COLD);
+    } else {
+      mover_cola_cold(lru, nodo);
+    }
+    movidos++;
+  }
   
-  return;
+  //warm excedido
+  int vueltas = 0; //evita ciclar si todos los nodos de warm estan activos
+  while (lru->seg[WARM].tam > objWarm && movidos < MOVIMIENTOS_MANTENEDOR && vueltas < lru->seg[WARM].tam) {
+    nodo = lru->seg[WARM].tail;
+    if (tomar_activo(nodo)) {
+      modificar_lru(lru, nodo);
+      vueltas++;
+    } else {
+      mover_segmento(lru, nodo, COLD);
+    }
+    movidos++;
+  }
+  
+  pthread_mutex_unlock(&lru->lock);
+  
+  return movidos;
+}
+
+
+//thread mantenedor de la lru.
+//corre fuera del camino de los pedidos, haciendo pasadas periodicas
+//(sin dormir mientras haya trabajo pendiente).
+void* mantenedor_lru(void* args) {
+  
+  ListaLru lru = (ListaLru)args;
+  
+  for (;;) {
+    if (mantener_lru(lru) < MOVIMIENTOS_MANTENEDOR)
+      usleep(INTERVALO_MANTENEDOR);
+  }
+  
+  return NULL;
 }
 
 
 //funcion para crear la lru
 ListaLru crear_lru() {
   ListaLru lru = malloc(sizeof(struct ListaLru));
-  lru->head = NULL;
-  lru->tail = NULL;
+  for (int i = 0; i < NSEGMENTOS; i++) {
+    lru->seg[i].head = NULL;
+    lru->seg[i].tail = NULL;
+    lru->seg[i].tam = 0;
+  }
+  lru->sketch = crear_sketch();
+  
+  //recursivo: desalojo() lo toma y eliminar_nodo_lista() lo vuelve a tomar
+  pthread_mutexattr_t rec;
+  pthread_mutexattr_init(&rec);
+  pthread_mutexattr_settype(&rec, PTHREAD_MUTEX_RECURSIVE_NP);
+  pthread_mutex_init(&lru->lock, &rec);
+  pthread_mutexattr_destroy(&rec);
+  iniciar_perfil(&lru->perfil);
   return lru;
 }
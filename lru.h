@@ -2,12 +2,37 @@
 #define __HASH_LRU_H__
 #include <pthread.h>
 #include "hash_chaining.h"
+#include "cache_alloc.h"
+
+//mantenedor de la lru
+#define INTERVALO_MANTENEDOR 1000 //microsegundos entre pasadas
+#define MOVIMIENTOS_MANTENEDOR 1024 //nodos movidos como maximo por pasada
+
+//recolector (desalojo en segundo plano)
+#define MARCA_ALTA 90 //% del limite a partir del cual desaloja el recolector
+#define MARCA_BAJA 80 //% del limite hasta el que desaloja
+#define LOTE_DESALOJO 64 //elementos desalojados por cada toma del lock de la lru
+#define INTERVALO_RECOLECTOR 10000 //microsegundos entre chequeos
+
+//argumentos del recolector
+//(una tabla/lru por particion)
+typedef struct _recolectorArgs {
+  int cantidad;
+  TablaHash* tablas;
+  ListaLru* lrus;
+} *RecolectorArgs;
 
 //FUNCIONES LRU
 ListaLru crear_lru();
 void agregar_lru(ListaLru lru, HList* nodo);
 void eliminar_lru(ListaLru lru, HList* nodo);
 void modificar_lru(ListaLru lru, HList* nodo);
+int lru_vacia(ListaLru lru);
+void marcar_activo(HList* nodo);
+
+//FUNCIONES MANTENEDOR
+int mantener_lru(ListaLru lru);
+void* mantenedor_lru(void* args);
 
 //PARA TESTEO
 void imprimir_lru(ListaLru lru);
@@ -15,6 +40,12 @@ void imprimir_lru(ListaLru lru);
 //FUNCIONES DESALOJO/CHEQUEO MEMORIA DISPONIBLE
 void* safe_malloc(size_t size_type, int size, TablaHash tabla, ListaLru lru);
 
-void desalojo(TablaHash tabla, ListaLru lru);
+int desalojo(TablaHash tabla, ListaLru lru);
+
+int desalojo_lote(TablaHash tabla, ListaLru lru, int n);
+
+void configurar_memoria(size_t limite);
+
+void* recolector(void* args);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,71 @@
+#include <time.h>
+#include "perfil_locks.h"
+
+//se activa con -P, antes de crear los threads
+static int perfilActivo = 0;
+
+//tiempo actual en nanosegundos (reloj monotonico)
+static unsigned long long ahora_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//activa el perfilado de los locks
+void activar_perfil_locks() {
+  perfilActivo = 1;
+}
+
+//retorna 1 si el perfilado esta activo
+int perfil_locks_activo() {
+  return perfilActivo;
+}
+
+//pone los contadores en 0
+void iniciar_perfil(PerfilLock* perfil) {
+  perfil->adquisiciones = 0;
+  perfil->contendidas = 0;
+  perfil->fallidos = 0;
+  perfil->esperaNs = 0;
+}
+
+//pone los contadores en 0 mientras otros threads pueden estar usando el lock
+//(LOCKSTATS_RESET)
+void reiniciar_perfil(PerfilLock* perfil) {
+  __atomic_store_n(&perfil->adquisiciones, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&perfil->contendidas, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&perfil->fallidos, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&perfil->esperaNs, 0, __ATOMIC_RELAXED);
+}
+
+//toma el lock, contando la espera si estaba ocupado.
+//solo se mide el tiempo cuando hay que esperar, el camino
+//sin disputa es un trylock y un incremento.
+void bloquear(pthread_mutex_t* lock, PerfilLock* perfil) {
+  
+  if (!perfilActivo) {
+    pthread_mutex_lock(lock);
+    return;
+  }
+  
+  if (pthread_mutex_trylock(lock) != 0) {
+    unsigned long long inicio = ahora_ns();
+    pthread_mutex_lock(lock);
+    __atomic_add_fetch(&perfil->esperaNs, ahora_ns() - inicio, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&perfil->contendidas, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&perfil->adquisiciones, 1, __ATOMIC_RELAXED);
+}
+
+//intenta tomar el lock sin esperar (como pthread_mutex_trylock).
+//si estaba ocupado lo cuenta como intento fallido.
+int intentar_bloquear(pthread_mutex_t* lock, PerfilLock* perfil) {
+  
+  int rc = pthread_mutex_trylock(lock);
+  
+  if (perfilActivo) {
+    if (rc == 0) __atomic_add_fetch(&perfil->adquisiciones, 1, __ATOMIC_RELAXED);
+    else __atomic_add_fetch(&perfil->fallidos, 1, __ATOMIC_RELAXED);
+  }
+  return rc;
+}
@@ -0,0 +1,34 @@
+#ifndef __PERFIL_LOCKS_H__
+#define __PERFIL_LOCKS_H__
+#include <pthread.h>
+
+//perfilado opcional de los locks (opcion -P del servidor).
+//cada lock perfilado lleva la cantidad de veces que se tomo, cuantas
+//de esas estaba ocupado y el tiempo total que se espero por el.
+//los intentos sin espera (intentar_bloquear) que lo encontraron ocupado
+//se cuentan aparte: no son adquisiciones.
+//sin -P, bloquear() es un pthread_mutex_lock y no se cuenta nada.
+
+#define LOCKS_REPORTE 10 //secciones en el reporte de las mas disputadas
+
+typedef struct _perfilLock {
+  unsigned long adquisiciones;
+  unsigned long contendidas; //adquisiciones en las que estaba tomado por otro thread
+  unsigned long fallidos; //intentos sin espera que lo encontraron tomado
+  unsigned long long esperaNs; //tiempo total esperando
+} PerfilLock;
+
+//FUNCIONES PERFIL
+void activar_perfil_locks();
+
+int perfil_locks_activo();
+
+void iniciar_perfil(PerfilLock* perfil);
+
+void reiniciar_perfil(PerfilLock* perfil);
+
+void bloquear(pthread_mutex_t* lock, PerfilLock* perfil);
+
+int intentar_bloquear(pthread_mutex_t* lock, PerfilLock* perfil);
+
+#endif
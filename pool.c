@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "pool.h"
+
+#define MPOL_BIND 2 //de <numaif.h>, para no depender de libnuma
+
+//region reservada al inicio, dividida entre los nodos NUMA
+static PoolNodo nodos[MAX_NODOS_NUMA];
+static int cantNodos = 0;
+
+//nodo NUMA del thread actual (-1 si todavia no se consulto)
+static __thread int nodoLocal = -1;
+
+//cantidad de nodos NUMA del sistema (1 si no se puede determinar)
+static int contar_nodos() {
+  int n = 0;
+  char ruta[64];
+  for (; n < MAX_NODOS_NUMA; n++) {
+    snprintf(ruta, sizeof(ruta), "/sys/devices/system/node/node%d", n);
+    if (access(ruta, F_OK) != 0) break;
+  }
+  return n > 0 ? n : 1;
+}
+
+//un bloque libre se reconoce por su cabecera, en el mismo lugar que la de uno en uso
+_Static_assert(offsetof(BloqueLibre, marca) == offsetof(Cabecera, clase), "cabeceras del pool");
+_Static_assert(sizeof(BloqueLibre) <= (1 << ORDEN_MIN) && (1 << ORDEN_MIN) <= TAM_MIN, "orden minimo del pool");
+
+//agrega un bloque a la lista libre de su orden, con p->lock tomado
+static void agregar_libre(PoolNodo* p, BloqueLibre* b, int orden) {
+  b->marca = BLOQUE_LIBRE;
+  b->orden = orden;
+  b->ant = NULL;
+  b->sig = p->libres[orden];
+  if (b->sig != NULL) b->sig->ant = b;
+  p->libres[orden] = b;
+}
+
+//saca un bloque de la lista libre de su orden, con p->lock tomado
+static void quitar_libre(PoolNodo* p, BloqueLibre* b) {
+  if (b->ant != NULL) b->ant->sig = b->sig;
+  else p->libres[b->orden] = b->sig;
+  if (b->sig != NULL) b->sig->ant = b->ant;
+}
+
+//reserva la region del pool. intenta primero con huge pages de 2MB
+//(MAP_HUGETLB, requiere paginas reservadas en /proc/sys/vm/nr_hugepages)
+//y si no puede usa paginas normales, pidiendo transparent huge pages.
+//en hosts con varios nodos NUMA, cada porcion se liga a su nodo.
+//cada porcion empieza como bloques libres del buddy.
+//retorna 0 si pudo reservar, -1 si no.
+int crear_pool(size_t bytes, int hugepages) {
+  
+  size_t total = (bytes + TAM_HUGEPAGE - 1) / TAM_HUGEPAGE * TAM_HUGEPAGE; //multiplo de 2MB
+  char* region = MAP_FAILED;
+  
+  if (hugepages) {
+    region = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region == MAP_FAILED)
+      perror("mmap con huge pages, se usan paginas normales");
+  }
+  if (region == MAP_FAILED) {
+    region = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+      perror("mmap del pool");
+      return -1;
+    }
+    madvise(region, total, MADV_HUGEPAGE);
+  }
+  
+  cantNodos = contar_nodos();
+  size_t porcion = total / cantNodos / TAM_HUGEPAGE * TAM_HUGEPAGE;
+  
+  for (int i = 0; i < cantNodos; i++) {
+    PoolNodo* p = &nodos[i];
+    p->inicio = region + i * porcion;
+    p->tam = (i == cantNodos - 1) ? total - i * porcion : porcion;
+    memset(p->libres, 0, sizeof(p->libres));
+    pthread_mutex_init(&p->lock, 0);
+    
+    if (cantNodos > 1) { //ligamos la porcion a su nodo (si falla, queda la politica por defecto)
+      unsigned long mascara = 1UL << i;
+      if (syscall(SYS_mbind, p->inicio, p->tam, MPOL_BIND, &mascara, sizeof(mascara) * 8, 0) != 0)
+        perror("mbind");
+    }
+    
+    //dividimos la porcion en los bloques mas grandes posibles,
+    //cada uno alineado a su tamaño (desde el inicio de la porcion)
+    size_t off = 0;
+    while (off < p->tam) {
+      int orden = ORDENES - 1;
+      while (off % ((size_t)1 << orden) != 0 || off + ((size_t)1 << orden) > p->tam) orden--;
+      agregar_libre(p, (BloqueLibre*)(p->inicio + off), orden);
+      off += (size_t)1 << orden;
+    }
+  }
+  
+  return 0;
+}
+
+//retorna 1 si se reservo el pool
+int pool_activo() {
+  return cantNodos > 0;
+}
+
+//nodo NUMA en el que corre el thread.
+//se consulta una sola vez: el thread queda asociado al pool de ese nodo
+static int nodo_actual() {
+  if (nodoLocal < 0) {
+    unsigned cpu, nodo;
+    if (syscall(SYS_getcpu, &cpu, &nodo, NULL) != 0 || (int)nodo >= cantNodos) nodo = 0;
+    nodoLocal = nodo;
+  }
+  return nodoLocal;
+}
+
+//orden del menor bloque de al menos tam bytes
+int orden_de(size_t tam) {
+  int orden = ORDEN_MIN;
+  while (orden < ORDENES && ((size_t)1 << orden) < tam) orden++;
+  return orden;
+}
+
+//obtiene un bloque de 2^orden bytes del pool del nodo del thread (o de otro
+//nodo si el propio no tiene), partiendo un bloque libre mas grande si hace
+//falta. guarda en *nodo de que pool salio. retorna NULL si no hay ninguno.
+void* tomar_pool(int orden, int* nodo) {
+  
+  if (orden >= ORDENES) return NULL;
+  int propio = nodo_actual();
+  
+  for (int i = 0; i < cantNodos; i++) {
+    int n = (propio + i) % cantNodos;
+    PoolNodo* p = &nodos[n];
+    
+    pthread_mutex_lock(&p->lock);
+    int k = orden;
+    while (k < ORDENES && p->libres[k] == NULL) k++;
+    if (k == ORDENES) {
+      pthread_mutex_unlock(&p->lock);
+      continue;
+    }
+    
+    BloqueLibre* b = p->libres[k];
+    quitar_libre(p, b);
+    while (k > orden) { //la mitad de arriba queda libre
+      k--;
+      agregar_libre(p, (BloqueLibre*)((char*)b + ((size_t)1 << k)), k);
+    }
+    b->marca = 0; //ya no es un bloque libre, que no lo junte un devolver_pool
+    pthread_mutex_unlock(&p->lock);
+    
+    *nodo = n;
+    return b;
+  }
+  
+  return NULL;
+}
+
+//devuelve un bloque de 2^orden bytes al pool del que salio,
+//juntandolo con su buddy mientras este tambien este libre
+void devolver_pool(void* bloque, int orden, int nodo) {
+  
+  PoolNodo* p = &nodos[nodo];
+  size_t off = (char*)bloque - p->inicio;
+  
+  pthread_mutex_lock(&p->lock);
+  while (orden < ORDENES - 1) {
+    size_t offBuddy = off ^ ((size_t)1 << orden);
+    if (offBuddy + ((size_t)1 << orden) > p->tam) break; //el buddy quedaria fuera de la porcion
+    
+    //el buddy empieza en un limite de bloque: o es un bloque libre,
+    //o tiene la cabecera de uno en uso
+    BloqueLibre* buddy = (BloqueLibre*)(p->inicio + offBuddy);
+    if (buddy->marca != BLOQUE_LIBRE || buddy->orden != orden) break;
+    
+    quitar_libre(p, buddy);
+    if (offBuddy < off) off = offBuddy;
+    orden++;
+  }
+  agregar_libre(p, (BloqueLibre*)(p->inicio + off), orden);
+  pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,50 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+#include <stddef.h>
+#include <pthread.h>
+#include "cache_alloc.h"
+
+#define TAM_HUGEPAGE (2 * 1024 * 1024)
+#define MAX_NODOS_NUMA 16
+
+//ordenes del buddy: bloques de 2^orden bytes (con la cabecera incluida).
+//el menor tiene lugar para la cabecera de un bloque libre
+#define ORDEN_MIN 5
+#define ORDENES 48
+
+//marca que lleva en el campo clase de la cabecera un bloque libre del pool
+//(los bloques en uso o en las caches de los threads tienen su clase, >= -1)
+#define BLOQUE_LIBRE -2
+
+//cabecera de un bloque libre del pool. los campos marca y orden ocupan
+//el lugar de clase y nodo de la Cabecera de un bloque en uso
+typedef struct _bloqueLibre {
+  struct _bloqueLibre* sig;
+  int marca; //BLOQUE_LIBRE
+  int orden;
+  struct _bloqueLibre* ant;
+} BloqueLibre;
+
+//pool de un nodo NUMA: una porcion de la region reservada, administrada
+//como buddy. un bloque libre se parte a la mitad hasta llegar al orden
+//pedido, y al devolverlo se junta con su buddy si tambien esta libre,
+//asi la memoria que dejo una clase puede usarla cualquier otra
+typedef struct _poolNodo {
+  char* inicio;
+  size_t tam;
+  BloqueLibre* libres[ORDENES]; //bloques libres de cada orden
+  pthread_mutex_t lock; //protege libres y las cabeceras de los bloques libres
+} PoolNodo;
+
+//FUNCIONES POOL
+int crear_pool(size_t bytes, int hugepages);
+
+int pool_activo();
+
+int orden_de(size_t tam);
+
+void* tomar_pool(int orden, int* nodo);
+
+void devolver_pool(void* bloque, int orden, int nodo);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef __PROTOCOLO_H__
+#define __PROTOCOLO_H__
+
+//codigos binarios
+//compartidos por el servidor y la biblioteca de clientes locales
+enum code {
+	PUT = 11,
+	DEL = 12,
+	GET = 13,
+	CAS = 14,
+	INCR = 15,
+	DECR = 16,
+	APPEND = 17,
+	PREPEND = 18,
+	GETS = 19,
+
+	STATS = 21,
+	HOTKEYS = 22,
+	SHM = 23,
+	FLUSH_NS = 24,
+	FLUSH_ALL = 25,
+	LOCKSTATS = 26,
+	LATENCY = 27,
+	LATENCY_RESET = 28,
+	TRACK = 29,
+	LOCKSTATS_RESET = 30,
+
+	OK = 101,
+  OKE = 116,
+	EINVALID = 111,
+	ENOTFOUND = 112,
+	EBINARY = 113,
+	EBIG = 114,
+	EUNK = 115,
+	EVERSION = 117, //CAS: la version no coincide
+	ENONNUM = 118, //INCR/DECR: el valor no es numerico
+	EOVERLOAD = 119, //servidor sobrecargado, el pedido o la conexion se descartaron
+
+	//mensajes que el servidor manda sin que se los pidan (ver seguimiento.h)
+	INVALIDATE = 130, //+ longitud + clave (longitud 0: todas las claves)
+};
+
+#endif
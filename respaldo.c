@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "respaldo.h"
+
+static Respaldo* respaldo = NULL; //NULL si el servidor corre sin -B
+static void* estado;
+
+//locks de pendientes y esperas: la casilla i la protege locks[i % RESP_LOCKS].
+//anotar una escritura y marcar como sucia la lectura en curso de esa clave
+//tiene que ser atomico, y las dos estan en la misma casilla
+static pthread_mutex_t locks[RESP_LOCKS];
+static pthread_once_t iniciados = PTHREAD_ONCE_INIT;
+
+//para dormir al thread de escritura y a los pedidos que esperan lugar
+static pthread_mutex_t lockAviso = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hayPendientes = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t hayLugar = PTHREAD_COND_INITIALIZER;
+
+//escrituras pendientes y las del lote que se esta mandando
+//(se intercambian al vaciar, con todos los locks tomados, para que las lecturas vean ambas)
+static Escritura* tablaA[RESP_CASILLAS];
+static Escritura* tablaB[RESP_CASILLAS];
+static Escritura** pendientes = tablaA;
+static Escritura** escribiendo = tablaB;
+static long nPendientes = 0;
+static long bytes = 0; //memoria de pendientes y escribiendo
+
+//lecturas en curso
+static Espera* esperas[RESP_CASILLAS];
+
+//contadores (STATS)
+static long long lecturas = 0; //lecturas al respaldo
+static long long agrupadas = 0; //fallos que esperaron una lectura en curso
+static long long escrituras = 0; //escrituras mandadas al respaldo
+static long long reintentos = 0; //escrituras de lotes que fallaron
+
+static void iniciar_locks() {
+  for (int i = 0; i < RESP_LOCKS; i++) {
+    pthread_mutex_init(&locks[i], NULL);
+  }
+}
+
+static unsigned casilla(const char* clave) {
+  unsigned h = 2166136261u;
+  for (; *clave != '\0'; clave++) {
+    h = (h ^ (unsigned char)*clave) * 16777619u;
+  }
+  return h & (RESP_CASILLAS - 1);
+}
+
+static pthread_mutex_t* lock_de(unsigned idx) {
+  return &locks[idx % RESP_LOCKS];
+}
+
+//memoria que ocupa una escritura pendiente
+static long tam_escritura(const char* clave, const char* valor) {
+  return sizeof(Escritura) + strlen(clave) + 1 + (valor != NULL ? strlen(valor) + 1 : 0);
+}
+
+static Escritura* buscar_escritura(Escritura** tabla, const char* clave) {
+  for (Escritura* e = tabla[casilla(clave)]; e != NULL; e = e->sig) {
+    if (strcmp(e->clave, clave) == 0) return e;
+  }
+  return NULL;
+}
+
+static Espera* buscar_espera(const char* clave) {
+  for (Espera* w = esperas[casilla(clave)]; w != NULL; w = w->sig) {
+    if (strcmp(w->clave, clave) == 0) return w;
+  }
+  return NULL;
+}
+
+static void liberar_espera(Espera* w) {
+  pthread_cond_destroy(&w->cond);
+  free(w->clave);
+  free(w->valor);
+  free(w);
+}
+
+static void liberar_escritura(Escritura* e) {
+  __atomic_sub_fetch(&bytes, tam_escritura(e->clave, e->valor), __ATOMIC_RELAXED);
+  free(e->clave);
+  free(e->valor);
+  free(e);
+}
+
+//copia un valor (NULL si es NULL o no hay memoria)
+static char* copiar(const char* valor) {
+  return valor != NULL ? strdup(valor) : NULL;
+}
+
+//manda n escrituras al respaldo. si falla, las marca para reintentarlas
+static void escribir_lote(Escritura** lote, int n) {
+  
+  if (respaldo->escribir(estado, lote, n) == 0) {
+    __atomic_add_fetch(&escrituras, n, __ATOMIC_RELAXED);
+    return;
+  }
+  
+  fprintf(stderr, "Error escribiendo en el respaldo, se reintenta\n");
+  for (int i = 0; i < n; i++) {
+    lote[i]->fallida = 1;
+  }
+  __atomic_add_fetch(&reintentos, n, __ATOMIC_RELAXED);
+}
+
+//thread que manda las escrituras pendientes al respaldo cada RESP_DEMORA_MS,
+//en lotes de RESP_LOTE
+static void* vaciar_pendientes(void* arg) {
+  (void)arg;
+  
+  Escritura* lote[RESP_LOTE];
+  
+  while (1) {
+  
+    pthread_mutex_lock(&lockAviso);
+    while (__atomic_load_n(&nPendientes, __ATOMIC_RELAXED) == 0) pthread_cond_wait(&hayPendientes, &lockAviso);
+    pthread_mutex_unlock(&lockAviso);
+  
+    //intercambiamos las tablas: las nuevas escrituras van a una tabla vacia
+    for (int i = 0; i < RESP_LOCKS; i++) pthread_mutex_lock(&locks[i]);
+    Escritura** t = escribiendo;
+    escribiendo = pendientes;
+    pendientes = t;
+    __atomic_store_n(&nPendientes, 0, __ATOMIC_RELAXED);
+    for (int i = RESP_LOCKS - 1; i >= 0; i--) pthread_mutex_unlock(&locks[i]);
+  
+    //escribiendo no cambia hasta el proximo intercambio, la recorremos sin lock
+    int n = 0;
+    for (int i = 0; i < RESP_CASILLAS; i++) {
+      for (Escritura* e = escribiendo[i]; e != NULL; e = e->sig) {
+        lote[n++] = e;
+        if (n == RESP_LOTE) {
+          escribir_lote(lote, n);
+          n = 0;
+        }
+      }
+    }
+    if (n > 0) escribir_lote(lote, n);
+  
+    //las que llegaron al respaldo se liberan: las lecturas pueden ir a buscarlas ahi.
+    //las fallidas vuelven a pendientes, salvo que haya una escritura mas nueva de la clave
+    for (int l = 0; l < RESP_LOCKS; l++) {
+      pthread_mutex_lock(&locks[l]);
+      for (int i = l; i < RESP_CASILLAS; i += RESP_LOCKS) {
+        Escritura* e = escribiendo[i];
+        escribiendo[i] = NULL;
+        while (e != NULL) {
+          Escritura* sig = e->sig;
+          if (e->fallida && buscar_escritura(pendientes, e->clave) == NULL) {
+            e->fallida = 0;
+            e->sig = pendientes[i];
+            pendientes[i] = e;
+            __atomic_add_fetch(&nPendientes, 1, __ATOMIC_RELAXED);
+          } else {
+            liberar_escritura(e);
+          }
+          e = sig;
+        }
+      }
+      pthread_mutex_unlock(&locks[l]);
+    }
+  
+    //puede haber lugar para los pedidos que esperaban
+    pthread_mutex_lock(&lockAviso);
+    pthread_cond_broadcast(&hayLugar);
+    pthread_mutex_unlock(&lockAviso);
+  
+    //juntamos escrituras hasta el proximo lote (y si fallo, esperamos antes de reintentar)
+    struct timespec demora = {.tv_sec = 0, .tv_nsec = RESP_DEMORA_MS * 1000000L};
+    nanosleep(&demora, NULL);
+  }
+  return NULL;
+}
+
+//abre el respaldo y lanza el thread de escritura diferida.
+//retorna 0, o -1 si no se pudo abrir.
+int iniciar_respaldo(Respaldo* r, const char* arg) {
+  
+  pthread_once(&iniciados, iniciar_locks);
+  
+  estado = r->abrir(arg);
+  if (estado == NULL) return -1;
+  respaldo = r;
+  
+  pthread_t hilo;
+  pthread_create(&hilo, NULL, vaciar_pendientes, NULL);
+  return 0;
+}
+
+int hay_respaldo() {
+  return respaldo != NULL;
+}
+
+//busca la clave en el respaldo despues de un fallo en la cache.
+//si ya hay una lectura en curso de la clave, espera su resultado en lugar
+//de hacer otra. el que lee llama a guardar() para llevar el valor a la cache,
+//antes de dar por terminada la lectura (asi un fallo posterior la encuentra).
+//retorna el valor (malloc, lo libera el que llama) o NULL si no esta.
+char* leer_respaldo(char* clave, FuncionGuardar guardar, void* arg) {
+  
+  if (respaldo == NULL) return NULL;
+  
+  unsigned idx = casilla(clave);
+  pthread_mutex_t* lock = lock_de(idx);
+  pthread_mutex_lock(lock);
+  
+  //una escritura que todavia no llego al respaldo tiene el valor mas nuevo
+  Escritura* e = buscar_escritura(pendientes, clave);
+  if (e == NULL) e = buscar_escritura(escribiendo, clave);
+  int pendiente = e != NULL;
+  char* valor = pendiente ? copiar(e->valor) : NULL;
+  
+  Espera* w = pendiente ? NULL : buscar_espera(clave);
+  if (w != NULL) { //otro thread la esta leyendo
+    w->refs++;
+    __atomic_add_fetch(&agrupadas, 1, __ATOMIC_RELAXED);
+    while (!w->listo) pthread_cond_wait(&w->cond, lock);
+    valor = copiar(w->valor);
+    if (--w->refs == 0) liberar_espera(w);
+    pthread_mutex_unlock(lock);
+    return valor;
+  }
+  
+  if (pendiente && valor == NULL) { //se borro (o no hay memoria para la copia)
+    pthread_mutex_unlock(lock);
+    return NULL;
+  }
+  
+  //somos los primeros, anotamos la lectura en curso. si el valor salio de
+  //una escritura pendiente tambien: una escritura posterior lo ensucia
+  w = calloc(1, sizeof(Espera));
+  if (w == NULL || (w->clave = strdup(clave)) == NULL) {
+    pthread_mutex_unlock(lock);
+    free(w);
+    return valor;
+  }
+  w->refs = 1;
+  pthread_cond_init(&w->cond, NULL);
+  w->sig = esperas[idx];
+  esperas[idx] = w;
+  if (!pendiente) __atomic_add_fetch(&lecturas, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(lock);
+  
+  if (!pendiente) valor = respaldo->leer(estado, clave);
+  
+  //la guardamos en la cache; guardar() consulta clave_limpia()
+  //con la seccion de la tablahash tomada
+  if (valor != NULL) guardar(clave, valor, arg);
+  
+  pthread_mutex_lock(lock);
+  
+  //la sacamos de las lecturas en curso y despertamos a los que esperaban
+  Espera** ant = &esperas[idx];
+  while (*ant != w) ant = &(*ant)->sig;
+  *ant = w->sig;
+  
+  w->valor = copiar(valor);
+  w->listo = 1;
+  pthread_cond_broadcast(&w->cond);
+  if (--w->refs == 0) liberar_espera(w);
+  
+  pthread_mutex_unlock(lock);
+  
+  return valor;
+}
+
+//retorna 1 si la clave no se escribio desde que empezo su lectura del respaldo,
+//es decir si el valor leido se puede guardar en la cache.
+//se llama con la seccion de la tablahash de la clave tomada: las escrituras
+//se anotan con esa misma seccion tomada, asi que una escritura posterior
+//pisa lo que guardemos.
+int clave_limpia(char* clave) {
+  pthread_mutex_t* lock = lock_de(casilla(clave));
+  pthread_mutex_lock(lock);
+  Espera* w = buscar_espera(clave);
+  int limpia = w == NULL || !w->sucio;
+  pthread_mutex_unlock(lock);
+  return limpia;
+}
+
+//si las escrituras pendientes ocupan RESP_MAX_MB, espera hasta RESP_ESPERA_MS
+//a que el thread de escritura haga lugar.
+//se llama antes de ejecutar un pedido que escribe, sin ningun lock tomado.
+//retorna 0 si hay lugar, o -1 si no (el pedido se descarta)
+int esperar_lugar_respaldo() {
+  
+  long max = RESP_MAX_MB * 1024L * 1024L;
+  if (respaldo == NULL || __atomic_load_n(&bytes, __ATOMIC_RELAXED) < max) return 0;
+  
+  struct timespec limite;
+  clock_gettime(CLOCK_REALTIME, &limite);
+  limite.tv_sec += RESP_ESPERA_MS / 1000;
+  limite.tv_nsec += (RESP_ESPERA_MS % 1000) * 1000000L;
+  if (limite.tv_nsec >= 1000000000L) {
+    limite.tv_sec++;
+    limite.tv_nsec -= 1000000000L;
+  }
+  
+  int rc = 0;
+  pthread_mutex_lock(&lockAviso);
+  while (__atomic_load_n(&bytes, __ATOMIC_RELAXED) >= max && rc != ETIMEDOUT) {
+    rc = pthread_cond_timedwait(&hayLugar, &lockAviso, &limite);
+  }
+  pthread_mutex_unlock(&lockAviso);
+  
+  return __atomic_load_n(&bytes, __ATOMIC_RELAXED) < max ? 0 : -1;
+}
+
+//anota una escritura (valor NULL: DEL) para mandarla al respaldo.
+//se llama con la seccion de la tablahash de la clave tomada, asi las
+//escrituras de una misma clave se anotan en el orden en que se hicieron.
+void anotar_escritura(char* clave, char* valor) {
+  
+  if (respaldo == NULL) return;
+  
+  char* copiaValor = copiar(valor);
+  if (valor != NULL && copiaValor == NULL) {
+    fprintf(stderr, "Error: sin memoria para anotar una escritura del respaldo\n");
+    return;
+  }
+  
+  unsigned idx = casilla(clave);
+  pthread_mutex_t* lock = lock_de(idx);
+  pthread_mutex_lock(lock);
+  
+  Escritura* e = buscar_escritura(pendientes, clave);
+  if (e != NULL) { //solo nos importa la ultima
+    __atomic_add_fetch(&bytes, tam_escritura(clave, copiaValor) - tam_escritura(clave, e->valor), __ATOMIC_RELAXED);
+    free(e->valor);
+    e->valor = copiaValor;
+  } else if ((e = malloc(sizeof(Escritura))) != NULL && (e->clave = strdup(clave)) != NULL) {
+    e->valor = copiaValor;
+    e->fallida = 0;
+    e->sig = pendientes[idx];
+    pendientes[idx] = e;
+    __atomic_add_fetch(&bytes, tam_escritura(clave, copiaValor), __ATOMIC_RELAXED);
+    if (__atomic_fetch_add(&nPendientes, 1, __ATOMIC_RELAXED) == 0) {
+      pthread_mutex_lock(&lockAviso);
+      pthread_cond_signal(&hayPendientes);
+      pthread_mutex_unlock(&lockAviso);
+    }
+  } else {
+    fprintf(stderr, "Error: sin memoria para anotar una escritura del respaldo\n");
+    free(e);
+    free(copiaValor);
+  }
+  
+  //si se esta leyendo la clave del respaldo, lo leido ya no sirve
+  Espera* w = buscar_espera(clave);
+  if (w != NULL) w->sucio = 1;
+  
+  pthread_mutex_unlock(lock);
+}
+
+//contadores del respaldo, para STATS
+int reporte_respaldo(char* buffer, int tam) {
+  return snprintf(buffer, tam, "BACKEND=%s BACKEND_READS=%lld BACKEND_COALESCED=%lld BACKEND_WRITES=%lld BACKEND_RETRIED=%lld BACKEND_PENDING=%ld BACKEND_PENDING_BYTES=%ld\n",
+                  respaldo->nombre, __atomic_load_n(&lecturas, __ATOMIC_RELAXED),
+                  __atomic_load_n(&agrupadas, __ATOMIC_RELAXED),
+                  __atomic_load_n(&escrituras, __ATOMIC_RELAXED),
+                  __atomic_load_n(&reintentos, __ATOMIC_RELAXED),
+                  __atomic_load_n(&nPendientes, __ATOMIC_RELAXED),
+                  __atomic_load_n(&bytes, __ATOMIC_RELAXED));
+}
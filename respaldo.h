@@ -0,0 +1,75 @@
+#ifndef __RESPALDO_H__
+#define __RESPALDO_H__
+#include <pthread.h>
+
+//almacenamiento de respaldo (la base de datos detras de la cache).
+//
+//lectura a traves: un GET/GETS (o un CAS, INCR/DECR, APPEND/PREPEND) que no
+//encuentra la clave la pide al respaldo y la guarda en la cache. los fallos
+//simultaneos de una misma clave se agrupan: el primero hace la lectura y los
+//demas esperan su resultado.
+//
+//escritura diferida: los PUT/DEL (y CAS, INCR/DECR, APPEND/PREPEND) se anotan
+//con la seccion de la tablahash tomada y un thread los manda al respaldo por
+//lotes. de cada clave solo queda la ultima escritura pendiente, y una lectura
+//a traves la ve antes de ir al respaldo. los lotes que fallan se reintentan.
+//las escrituras pendientes ocupan como maximo RESP_MAX_MB: con la tabla llena
+//los pedidos que escriben esperan lugar (hasta RESP_ESPERA_MS) o se descartan.
+
+#define RESP_CASILLAS 4096 //casillas de las tablas de pendientes/esperas (potencia de 2)
+#define RESP_LOCKS 64 //locks de las tablas (divide a RESP_CASILLAS)
+#define RESP_LOTE 256 //escrituras por llamada a escribir()
+#define RESP_DEMORA_MS 100 //cada cuanto se vacian las escrituras pendientes
+#define RESP_MAX_MB 64 //memoria de las escrituras pendientes como maximo
+#define RESP_ESPERA_MS 500 //cuanto espera lugar un pedido que escribe
+
+//una escritura para el respaldo (valor NULL: borrar la clave)
+typedef struct _escritura {
+  char* clave;
+  char* valor;
+  int fallida; //su lote no se pudo escribir, se reintenta
+  struct _escritura* sig;
+} Escritura;
+
+//interfaz de un respaldo.
+//leer y escribir se llaman sin ningun lock tomado y pueden bloquear.
+typedef struct _respaldo {
+  const char* nombre;
+  //prepara el respaldo a partir del argumento de -B, retorna su estado (NULL si falla)
+  void* (*abrir)(const char* arg);
+  //retorna el valor de la clave (malloc, terminado en '\0') o NULL si no esta
+  char* (*leer)(void* estado, const char* clave);
+  //aplica n escrituras, retorna 0 o -1
+  int (*escribir)(void* estado, Escritura** lote, int n);
+} Respaldo;
+
+//lectura en curso de una clave (agrupa los fallos simultaneos)
+typedef struct _espera {
+  char* clave;
+  char* valor; //resultado, cuando listo
+  int listo;
+  int sucio; //la clave se escribio durante la lectura, no hay que guardarla
+  int refs; //threads que usan la espera
+  pthread_cond_t cond;
+  struct _espera* sig;
+} Espera;
+
+//guarda en la cache el valor leido del respaldo (lo implementa el servidor)
+typedef void (*FuncionGuardar) (char* clave, char* valor, void* arg);
+
+//FUNCIONES RESPALDO
+int iniciar_respaldo(Respaldo* r, const char* arg);
+
+int hay_respaldo();
+
+char* leer_respaldo(char* clave, FuncionGuardar guardar, void* arg);
+
+int clave_limpia(char* clave);
+
+int esperar_lugar_respaldo();
+
+void anotar_escritura(char* clave, char* valor);
+
+int reporte_respaldo(char* buffer, int tam);
+
+#endif
@@ -0,0 +1,128 @@
+#define _GNU_SOURCE //syncfs
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "respaldo_archivos.h"
+
+//estado del respaldo: el directorio abierto
+typedef struct _archivos {
+  int dirfd;
+} *Archivos;
+
+//nombre del archivo de la clave (16 digitos hexa + '\0')
+static void nombre_archivo(const char* clave, char* nombre) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *clave != '\0'; clave++) {
+    h = (h ^ (unsigned char)*clave) * 1099511628211ULL;
+  }
+  snprintf(nombre, 17, "%016llx", (unsigned long long)h);
+}
+
+static void* abrir_archivos(const char* dir) {
+  mkdir(dir, 0755); //si ya existe, lo usamos
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    perror("No se pudo abrir el directorio del respaldo");
+    return NULL;
+  }
+  Archivos a = malloc(sizeof(struct _archivos));
+  a->dirfd = fd;
+  return a;
+}
+
+static char* leer_archivo(void* estado, const char* clave) {
+  
+  Archivos a = estado;
+  char nombre[17];
+  nombre_archivo(clave, nombre);
+  
+  int fd = openat(a->dirfd, nombre, O_RDONLY);
+  if (fd < 0) return NULL; //no esta
+  
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  
+  char* contenido = malloc(st.st_size + 1);
+  ssize_t leido = 0;
+  while (contenido != NULL && leido < st.st_size) {
+    ssize_t rc = read(fd, contenido + leido, st.st_size - leido);
+    if (rc <= 0) break;
+    leido += rc;
+  }
+  close(fd);
+  if (contenido == NULL || leido < st.st_size) {
+    free(contenido);
+    return NULL;
+  }
+  contenido[leido] = '\0';
+  
+  //el archivo puede ser de otra clave con el mismo hash
+  size_t lenClave = strlen(clave);
+  if ((size_t)leido <= lenClave || memcmp(contenido, clave, lenClave + 1) != 0) {
+    free(contenido);
+    return NULL;
+  }
+  
+  memmove(contenido, contenido + lenClave + 1, leido - lenClave); //el valor y su '\0'
+  return contenido;
+}
+
+//escribe todo el buffer, retorna 0 o -1
+static int escribir_todo(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t rc = write(fd, buf, len);
+    if (rc <= 0) return -1;
+    buf += rc;
+    len -= rc;
+  }
+  return 0;
+}
+
+static int escribir_archivos(void* estado, Escritura** lote, int n) {
+  
+  Archivos a = estado;
+  int r = 0;
+  
+  for (int i = 0; i < n; i++) {
+    
+    char nombre[17];
+    nombre_archivo(lote[i]->clave, nombre);
+    
+    if (lote[i]->valor == NULL) { //DEL
+      unlinkat(a->dirfd, nombre, 0);
+      continue;
+    }
+    
+    //escribimos en un temporal y lo renombramos, asi una lectura
+    //nunca ve un archivo a medio escribir
+    char temporal[22];
+    snprintf(temporal, sizeof(temporal), "%s.tmp", nombre);
+    int fd = openat(a->dirfd, temporal, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      r = -1;
+      continue;
+    }
+    int rc = escribir_todo(fd, lote[i]->clave, strlen(lote[i]->clave) + 1);
+    if (rc == 0) rc = escribir_todo(fd, lote[i]->valor, strlen(lote[i]->valor));
+    close(fd);
+    if (rc != 0 || renameat(a->dirfd, temporal, a->dirfd, nombre) != 0) r = -1;
+  }
+  
+  //un solo sync por lote
+  if (syncfs(a->dirfd) != 0) r = -1;
+  return r;
+}
+
+Respaldo respaldoArchivos = {
+  .nombre = "archivos",
+  .abrir = abrir_archivos,
+  .leer = leer_archivo,
+  .escribir = escribir_archivos,
+};
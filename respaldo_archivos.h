@@ -0,0 +1,11 @@
+#ifndef __RESPALDO_ARCHIVOS_H__
+#define __RESPALDO_ARCHIVOS_H__
+#include "respaldo.h"
+
+//respaldo de referencia (-B directorio): un archivo por clave en el directorio,
+//nombrado con un hash de 64 bits de la clave y con contenido "clave\0valor".
+//las escrituras van a un archivo temporal que se renombra, y cada lote
+//termina con un syncfs del directorio.
+extern Respaldo respaldoArchivos;
+
+#endif
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "seguimiento.h"
+#include "protocolo.h"
+
+#define PALABRAS_GRUPOS (SEG_CASILLAS / SEG_GRUPO / 64)
+
+//tabla de claves seguidas
+static Anotacion* casillas[SEG_CASILLAS];
+static pthread_mutex_t locks[SEG_LOCKS];
+static long anotaciones = 0;
+
+//estado de cada conexion (indexado por fd)
+static int activo[SEG_MAX_FD]; //la conexion mando TRACK
+static unsigned genFd[SEG_MAX_FD]; //cambia al cerrarse, las anotaciones viejas se ignoran
+static pthread_mutex_t lockEscritura[SEG_MAX_FD]; //serializa las escrituras en el socket
+static uint64_t grupos[SEG_MAX_FD][PALABRAS_GRUPOS]; //grupos de casillas donde la conexion anoto claves
+
+//bandejas de salida, cada lock protege las de los fd % SEG_LOCKS.
+//solo se toman para copiar o sacar los avisos, nunca durante una escritura
+static Bandeja bandejas[SEG_MAX_FD];
+static pthread_mutex_t locksBandeja[SEG_LOCKS];
+
+//conexiones a las que este thread les encolo avisos (ver enviar_avisos)
+static __thread int* pendientes = NULL;
+static __thread int nPendientes = 0;
+static __thread int capPendientes = 0;
+
+//cantidad de conexiones que siguen claves (si es 0 no hay nada que invalidar)
+static int conexiones = 0;
+
+//hash de la clave
+static unsigned hash_clave(const char* clave) {
+  unsigned h = 2166136261u;
+  for (; *clave != '\0'; clave++) {
+    h = (h ^ (unsigned char)*clave) * 16777619u;
+  }
+  return h;
+}
+
+//inicializa los mutex, antes de crear los threads
+void iniciar_seguimiento() {
+  for (int i = 0; i < SEG_LOCKS; i++) {
+    pthread_mutex_init(&locks[i], NULL);
+    pthread_mutex_init(&locksBandeja[i], NULL);
+  }
+  for (int i = 0; i < SEG_MAX_FD; i++) {
+    pthread_mutex_init(&lockEscritura[i], NULL);
+  }
+}
+
+//la conexion empieza a seguir las claves que lee (TRACK).
+//retorna 0, o -1 si el fd es demasiado grande.
+int activar_seguimiento(int fd) {
+  if (fd < 0 || fd >= SEG_MAX_FD) return -1;
+  if (!activo[fd]) {
+    pthread_mutex_lock(&locksBandeja[fd % SEG_LOCKS]);
+    activo[fd] = 1;
+    pthread_mutex_unlock(&locksBandeja[fd % SEG_LOCKS]);
+    __atomic_add_fetch(&conexiones, 1, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+//retorna 1 si la conexion sigue claves.
+//activo[fd] solo lo cambia el thread que atiende a la conexion
+int seguimiento_activo(int fd) {
+  return fd >= 0 && fd < SEG_MAX_FD && activo[fd];
+}
+
+//borra las anotaciones del fd en la casilla idx
+static void borrar_anotaciones(unsigned idx, int fd) {
+  
+  Anotacion* borradas = NULL;
+  
+  pthread_mutex_lock(&locks[idx % SEG_LOCKS]);
+  Anotacion** ant = &casillas[idx];
+  while (*ant != NULL) {
+    Anotacion* a = *ant;
+    if (a->fd == fd) {
+      *ant = a->sig;
+      a->sig = borradas;
+      borradas = a;
+    } else {
+      ant = &a->sig;
+    }
+  }
+  pthread_mutex_unlock(&locks[idx % SEG_LOCKS]);
+  
+  while (borradas != NULL) {
+    Anotacion* a = borradas;
+    borradas = a->sig;
+    free(a->clave);
+    free(a);
+    __atomic_sub_fetch(&anotaciones, 1, __ATOMIC_RELAXED);
+  }
+}
+
+//la conexion se va a cerrar: descartamos los avisos que no se mandaron y
+//borramos sus anotaciones, asi no ocupan lugar ni se le manda nada a otra
+//conexion que reuse el fd.
+//se llama antes del close, asi nadie anota claves con este fd mientras tanto
+void cerrar_seguimiento(int fd) {
+  
+  if (!seguimiento_activo(fd)) return;
+  
+  pthread_mutex_lock(&lockEscritura[fd]);
+  pthread_mutex_lock(&locksBandeja[fd % SEG_LOCKS]);
+  activo[fd] = 0;
+  genFd[fd]++;
+  free(bandejas[fd].datos);
+  memset(&bandejas[fd], 0, sizeof(Bandeja));
+  pthread_mutex_unlock(&locksBandeja[fd % SEG_LOCKS]);
+  pthread_mutex_unlock(&lockEscritura[fd]);
+  __atomic_sub_fetch(&conexiones, 1, __ATOMIC_RELAXED);
+  
+  //recorremos solo los grupos de casillas donde anoto claves
+  for (int w = 0; w < PALABRAS_GRUPOS; w++) {
+    uint64_t bits = __atomic_exchange_n(&grupos[fd][w], 0, __ATOMIC_RELAXED);
+    while (bits != 0) {
+      unsigned g = w * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      for (unsigned idx = g * SEG_GRUPO; idx < (g + 1) * SEG_GRUPO; idx++) {
+        borrar_anotaciones(idx, fd);
+      }
+    }
+  }
+}
+
+//anota que este thread le encolo avisos a la conexion
+static void agregar_pendiente(int fd) {
+  
+  if (nPendientes > 0 && pendientes[nPendientes - 1] == fd) return;
+  
+  if (nPendientes == capPendientes) {
+    int cap = capPendientes > 0 ? capPendientes * 2 : 16;
+    int* nuevos = realloc(pendientes, cap * sizeof(int));
+    if (nuevos == NULL) return; //se manda con la proxima respuesta de la conexion
+    pendientes = nuevos;
+    capPendientes = cap;
+  }
+  pendientes[nPendientes++] = fd;
+}
+
+//encola INVALIDATE + longitud + clave en la bandeja de la conexion, si sigue
+//siendo la misma (gen). no escribe en el socket, se puede llamar con la
+//seccion de la tablahash o la lru tomada.
+static void encolar_aviso(int fd, unsigned gen, const char* clave) {
+  
+  int len = strlen(clave);
+  pthread_mutex_t* lock = &locksBandeja[fd % SEG_LOCKS];
+  
+  pthread_mutex_lock(lock);
+  if (!activo[fd] || genFd[fd] != gen) {
+    pthread_mutex_unlock(lock);
+    return;
+  }
+  
+  Bandeja* b = &bandejas[fd];
+  int total = b->len + 5 + len;
+  if (!b->desbordada && total > SEG_MAX_BANDEJA) b->desbordada = 1;
+  if (!b->desbordada && total > b->cap) {
+    int cap = b->cap > 0 ? b->cap : 256;
+    while (cap < total) cap *= 2;
+    char* datos = realloc(b->datos, cap);
+    if (datos == NULL) {
+      b->desbordada = 1;
+    } else {
+      b->datos = datos;
+      b->cap = cap;
+    }
+  }
+  if (!b->desbordada) {
+    b->datos[b->len] = INVALIDATE;
+    uint32_t len_net = htonl(len);
+    memcpy(b->datos + b->len + 1, &len_net, 4);
+    memcpy(b->datos + b->len + 5, clave, len);
+    b->len = total;
+  }
+  pthread_mutex_unlock(lock);
+  
+  agregar_pendiente(fd);
+}
+
+//retorna 1 si la conexion tiene avisos sin mandar
+static int bandeja_pendiente(int fd) {
+  pthread_mutex_lock(&locksBandeja[fd % SEG_LOCKS]);
+  int pendiente = bandejas[fd].len > 0 || bandejas[fd].desbordada;
+  pthread_mutex_unlock(&locksBandeja[fd % SEG_LOCKS]);
+  return pendiente;
+}
+
+//manda los avisos encolados de la conexion, con lockEscritura[fd] tomado.
+//solo bloquea si bloqueante (lo llama el thread que le responde a la conexion);
+//si no, lo que no se pudo mandar cierra la conexion: el cliente la ve
+//cerrarse y descarta su cache.
+static void vaciar_bandeja(int fd, int bloqueante) {
+  
+  //sacamos los avisos de la bandeja y escribimos sin su lock
+  pthread_mutex_lock(&locksBandeja[fd % SEG_LOCKS]);
+  Bandeja b = bandejas[fd];
+  memset(&bandejas[fd], 0, sizeof(Bandeja));
+  pthread_mutex_unlock(&locksBandeja[fd % SEG_LOCKS]);
+  
+  int enviado = 0;
+  while (!b.desbordada && enviado < b.len) {
+    int rc = send(fd, b.datos + enviado, b.len - enviado, MSG_NOSIGNAL | (bloqueante ? 0 : MSG_DONTWAIT));
+    if (rc <= 0) break;
+    enviado += rc;
+  }
+  if (b.desbordada || enviado < b.len) {
+    fprintf(stderr, "No se pudo avisar una invalidacion, cerramos la conexion %d\n", fd);
+    shutdown(fd, SHUT_RDWR); //el worker la cierra en su proximo evento
+  }
+  free(b.datos);
+}
+
+//suelta lockEscritura[fd]. si mientras lo teniamos otro thread encolo avisos,
+//no pudo tomarlo y los dejo: los mandamos nosotros
+static void soltar_escritura(int fd) {
+  pthread_mutex_unlock(&lockEscritura[fd]);
+  while (bandeja_pendiente(fd) && pthread_mutex_trylock(&lockEscritura[fd]) == 0) {
+    vaciar_bandeja(fd, 0);
+    pthread_mutex_unlock(&lockEscritura[fd]);
+  }
+}
+
+//serializa las escrituras en una conexion que sigue claves.
+//la llama el thread que le responde, que primero manda los avisos encolados
+void bloquear_escritura(int fd) {
+  if (!seguimiento_activo(fd)) return;
+  pthread_mutex_lock(&lockEscritura[fd]);
+  vaciar_bandeja(fd, 1);
+}
+
+void desbloquear_escritura(int fd) {
+  if (seguimiento_activo(fd)) soltar_escritura(fd);
+}
+
+//manda los avisos que este thread encolo, sin esperar a nadie: si otro tiene
+//el lock de escritura de la conexion, los manda el al soltarlo.
+//se llama sin locks de la tablahash ni de la lru tomados
+void enviar_avisos() {
+  for (int i = 0; i < nPendientes; i++) {
+    int fd = pendientes[i];
+    if (pthread_mutex_trylock(&lockEscritura[fd]) != 0) continue;
+    vaciar_bandeja(fd, 0);
+    soltar_escritura(fd);
+  }
+  nPendientes = 0;
+}
+
+//anota que la conexion leyo la clave.
+//se llama antes de buscarla, asi una modificacion entre la busqueda y la
+//respuesta tambien se avisa (el cliente no guarda un valor invalidado mientras
+//esperaba la respuesta). si no hay lugar para anotarla, se avisa enseguida.
+void seguir_clave(char* clave, int fd) {
+  
+  unsigned idx = hash_clave(clave) & (SEG_CASILLAS - 1);
+  unsigned gen = genFd[fd]; //solo lo cambia este mismo thread al cerrar
+  
+  pthread_mutex_lock(&locks[idx % SEG_LOCKS]);
+  
+  for (Anotacion* a = casillas[idx]; a != NULL; a = a->sig) {
+    if (a->fd == fd && a->gen == gen && strcmp(a->clave, clave) == 0) {
+      pthread_mutex_unlock(&locks[idx % SEG_LOCKS]);
+      return; //ya estaba anotada
+    }
+  }
+  
+  Anotacion* a = NULL;
+  if (__atomic_add_fetch(&anotaciones, 1, __ATOMIC_RELAXED) <= SEG_MAX_ANOTACIONES)
+    a = malloc(sizeof(Anotacion));
+  if (a != NULL) a->clave = strdup(clave);
+  
+  if (a == NULL || a->clave == NULL) {
+    __atomic_sub_fetch(&anotaciones, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&locks[idx % SEG_LOCKS]);
+    free(a);
+    encolar_aviso(fd, gen, clave); //que el cliente no la guarde
+    return;
+  }
+  
+  a->fd = fd;
+  a->gen = gen;
+  a->sig = casillas[idx];
+  casillas[idx] = a;
+  
+  pthread_mutex_unlock(&locks[idx % SEG_LOCKS]);
+  
+  unsigned g = idx / SEG_GRUPO;
+  __atomic_or_fetch(&grupos[fd][g / 64], 1ULL << (g % 64), __ATOMIC_RELAXED);
+}
+
+//la clave cambio: encolamos el aviso a las conexiones que la seguian
+//y borramos sus anotaciones
+void invalidar_clave(char* clave) {
+  
+  if (__atomic_load_n(&conexiones, __ATOMIC_RELAXED) == 0) return;
+  
+  unsigned idx = hash_clave(clave) & (SEG_CASILLAS - 1);
+  Anotacion* avisos = NULL;
+  
+  //sacamos las anotaciones de la tabla y encolamos despues de soltar el lock
+  pthread_mutex_lock(&locks[idx % SEG_LOCKS]);
+  Anotacion** ant = &casillas[idx];
+  while (*ant != NULL) {
+    Anotacion* a = *ant;
+    if (strcmp(a->clave, clave) == 0) {
+      *ant = a->sig;
+      a->sig = avisos;
+      avisos = a;
+    } else {
+      ant = &a->sig;
+    }
+  }
+  pthread_mutex_unlock(&locks[idx % SEG_LOCKS]);
+  
+  while (avisos != NULL) {
+    Anotacion* a = avisos;
+    avisos = a->sig;
+    encolar_aviso(a->fd, a->gen, a->clave);
+    free(a->clave);
+    free(a);
+    __atomic_sub_fetch(&anotaciones, 1, __ATOMIC_RELAXED);
+  }
+}
+
+//FLUSH_NS/FLUSH_ALL: todas las conexiones que siguen claves
+//descartan su cache (INVALIDATE sin clave)
+void invalidar_todo() {
+  
+  if (__atomic_load_n(&conexiones, __ATOMIC_RELAXED) == 0) return;
+  
+  for (int fd = 0; fd < SEG_MAX_FD; fd++) {
+    if (__atomic_load_n(&activo[fd], __ATOMIC_RELAXED))
+      encolar_aviso(fd, __atomic_load_n(&genFd[fd], __ATOMIC_RELAXED), "");
+  }
+}
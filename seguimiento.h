@@ -0,0 +1,64 @@
+#ifndef __SEGUIMIENTO_H__
+#define __SEGUIMIENTO_H__
+
+//seguimiento de claves para caches del lado del cliente.
+//una conexion que manda TRACK queda anotada en cada clave que lee (GET/GETS).
+//cuando la clave cambia (insercion, CAS/INCR/APPEND, DEL o desalojo) el
+//servidor le manda a esas conexiones un mensaje INVALIDATE con la clave y
+//borra las anotaciones (hay que volver a leerla para seguirla).
+//FLUSH_NS/FLUSH_ALL mandan un INVALIDATE sin clave (invalidar todo).
+//
+//las claves cambian con la seccion de la tablahash (o la lru) tomada, asi que
+//ahi los mensajes solo se encolan en la bandeja de salida de la conexion.
+//el thread los manda despues con enviar_avisos(), ya sin locks.
+//la escritura en una conexion que sigue claves se serializa con un lock por
+//conexion, que los avisos solo intentan tomar: si lo tiene otro, ese vacia la
+//bandeja al soltarlo. si un cliente no lee y su socket o su bandeja se llenan,
+//se cierra la conexion en lugar de bloquear al thread (el cliente pierde su cache).
+//al cerrarse una conexion se borran sus anotaciones.
+
+#define SEG_MAX_FD 65536 //solo se siguen conexiones con fd menor
+#define SEG_CASILLAS 65536 //casillas de la tabla de claves seguidas (potencia de 2)
+#define SEG_LOCKS 1024 //secciones de la tabla
+#define SEG_MAX_ANOTACIONES 1000000 //anotaciones {clave, conexion} como maximo
+#define SEG_GRUPO 256 //casillas por grupo, para ubicar las anotaciones de una conexion al cerrarla
+#define SEG_MAX_BANDEJA (256 * 1024) //bytes de avisos sin mandar por conexion
+
+//anotacion de una conexion que sigue una clave
+typedef struct _anotacion {
+  char* clave;
+  int fd;
+  unsigned gen; //generacion del fd al anotarse (ver cerrar_seguimiento)
+  struct _anotacion* sig;
+} Anotacion;
+
+//bandeja de salida de una conexion: avisos encolados que todavia no se mandaron
+typedef struct _bandeja {
+  char* datos;
+  int len;
+  int cap;
+  int desbordada; //supero SEG_MAX_BANDEJA: se cierra la conexion en lugar de mandarla
+} Bandeja;
+
+//FUNCIONES SEGUIMIENTO
+void iniciar_seguimiento();
+
+int activar_seguimiento(int fd);
+
+int seguimiento_activo(int fd);
+
+void cerrar_seguimiento(int fd);
+
+void seguir_clave(char* clave, int fd);
+
+void invalidar_clave(char* clave);
+
+void invalidar_todo();
+
+void enviar_avisos();
+
+void bloquear_escritura(int fd);
+
+void desbloquear_escritura(int fd);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,57 +7,144 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
+#include <sys/ioctl.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <errno.h>
+#include <endian.h>
 #include "hash_chaining.h"
 #include "lru.h"
+#include "pool.h"
+#include "protocolo.h"
+#include "anillo.h"
+#include "cola.h"
+#include "perfil_locks.h"
+#include "latencia.h"
+#include "seguimiento.h"
+#include "respaldo.h"
+#include "respaldo_archivos.h"
 #include <pthread.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <math.h>
+#include <inttypes.h>
 //#include <sys/capability.h>
 
 //variables globales
 #define MAX_EVENTS 100
 #define NTHREADS 4
 #define PORT 8888
+#define MEMORIA_MB 2000 //presupuesto de memoria por defecto
+#define MARGEN_POOL_MB 256 //memoria fuera del pool (stacks, tablahash), los items no la usan
+#define PORC_ITEMS 75 //sin pool, % del limite de memoria que pueden ocupar los items
 
-//codigos binarios
-enum code {
-	PUT = 11,
-	DEL = 12,
-	GET = 13,
-
-	STATS = 21,
-
-	OK = 101,
-  OKE = 116,
-	EINVALID = 111,
-	ENOTFOUND = 112,
-	EBINARY = 113,
-	EBIG = 114,
-	EUNK = 115,
-};
-
-//mutex
-pthread_mutexattr_t recHash;
-pthread_mutex_t locks[LOCKS];
-pthread_mutexattr_t recLru;
-pthread_mutex_t lockLru;
-pthread_mutex_t lockStats;
+//limites de carga por defecto (opciones -c, -p y -d)
+#define MAX_CONEXIONES 1000 //conexiones abiertas a la vez
+#define PROFUNDIDAD 16 //pedidos de una conexion atendidos seguidos, antes de pasar a otra
+#define ESPERA_MAX_MS 0 //los pedidos que esperaron mas que esto se descartan (0 = nunca)
+#define MAX_ANILLOS 64 //conexiones por memoria compartida a la vez (cada una tiene su thread)
+#define ESPERA_ACEPTAR_MS 10 //pausa si sin fds libres no se pudo rechazar la conexion
+#define ESPERA_RETENIDOS_MS 1 //con -S, cada cuanto se reintentan los reenvios a una cola llena
 
 //estructura para pasar argumentos a wait_for_clients
 typedef struct _wfc {
   int lsock;
-	TablaHash *th;
-	ListaLru *lru;
+  int usock; //socket unix para clientes locales (-1 si no se usa)
+  int id; //numero de worker
+  int epfd; //instancia epoll del worker (sin -S es la misma para todos)
+  unsigned long long despertar; //cuando volvio epoll_wait (reloj_ns)
+  unsigned long long leyendo; //ns esperando claves y valores desde despertar
+  struct _reenvio* retenidos; //reenvios que no entraron en la cola del dueño, en orden
+  struct _reenvio* ultimoRetenido;
 } *Wfc;
 
-//fd de la instancia epoll
-int epfd;
+//canal por el que llegan los pedidos y se envian las respuestas:
+//un socket (tcp o unix) o los anillos de una region compartida
+typedef struct _canal {
+  int fd; //en los canales de memoria compartida, el socket unix del cliente
+  RegionCompartida* region; //NULL si el canal es un socket
+  char respuesta; //ultimo codigo respondido (para separar aciertos de fallos)
+} *Canal;
 
-//estructura global de stats
-Stats st;
+//pedido leido del canal
+typedef struct _pedido {
+  char comando;
+  char* clave;
+  int lenClave;
+  char* valor;
+  int lenValor;
+  uint64_t numero; //version de CAS o delta de INCR/DECR
+  unsigned long long inicio; //cuando se termino de leer (reloj_ns), para la latencia
+  unsigned long long llegada; //desde cuando lo tiene el worker (reloj_ns), para descartarlo
+} Pedido;
+
+//espera de un thread de memoria compartida a que el dueño ejecute su pedido
+typedef struct _fin {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int listo;
+} Fin;
+
+//pedido reenviado al dueño de la particion de su clave
+typedef struct _reenvio {
+  Pedido p;
+  int fd; //conexion a la que hay que responder
+  int epfd; //instancia epoll en la que hay que rearmar la conexion
+  struct _particion* destino;
+  struct _canal* canal; //canal de memoria compartida (NULL si la conexion es un socket)
+  Fin* fin; //se avisa cuando se ejecuto (solo memoria compartida)
+  struct _reenvio* sig;
+} *Reenvio;
+
+//particion del espacio de claves, con su propia tablahash, lru y stats.
+//sin -S hay una sola, compartida por todos los workers.
+//con -S cada worker (fijado a un procesador) es dueño de una y ejecuta
+//solo los pedidos de sus claves: los demas se los pasa al dueño por su cola.
+typedef struct _particion {
+  TablaHash th;
+  ListaLru lru;
+  Stats st;
+  ColaSPSC entrada[NTHREADS]; //pedidos reenviados, una cola por worker de origen
+  Reenvio entradaAnillos; //pedidos de los threads de memoria compartida
+  pthread_mutex_t lockAnillos;
+  int aviso; //eventfd para despertar al dueño (-1 sin -S)
+  int epfd; //instancia epoll del dueño
+} *Particion;
+
+//estructura para pasar argumentos a atender_anillo
+typedef struct _anilloArgs {
+  int sock;
+  RegionCompartida* region;
+} *AnilloArgs;
+
+//particiones
+Particion particiones[NTHREADS];
+int nParticiones = 1;
+int particionado = 0; //modo -S
+unsigned largoClave = 0; //-k, largo de clave con busqueda rapida (ver crear_tabla)
+
+//limites de carga
+int maxConexiones = MAX_CONEXIONES;
+int profundidad = PROFUNDIDAD;
+unsigned long long esperaMaxNs = ESPERA_MAX_MS * 1000000ULL;
+
+//contadores de sobrecarga (se muestran en STATS)
+long long int conexiones = 0; //abiertas
+long long int conexionesRechazadas = 0;
+int anillos = 0; //conexiones por memoria compartida (tambien cuentan en conexiones)
+long long int pedidosDescartados = 0;
+
+//fd de reserva: sin fds libres (EMFILE) se cierra para aceptar y rechazar la
+//conexion, si no quedaria en la cola de listen y epoll avisaria sin parar
+int fdReserva = -1;
+pthread_mutex_t lockReserva = PTHREAD_MUTEX_INITIALIZER;
+
+int atender_pedido(Canal c, Wfc w);
 
 //funcion utilizada en mk_lsock, para abortar en caso de error
 void quit(char *s) {
@@ -64,15 +152,51 @@ void quit(char *s) {
 	abort();
 }
 
+//lee len bytes del canal.
+//retorna 0 si pudo leerlos todos, -1 si no.
+int leer_canal(Canal c, void* buf, int len) {
+  
+  if (c->region != NULL)
+    return anillo_leer(&c->region->pedidos, buf, len, &c->region->cerrado, c->fd);
+  
+  int leido = 0; //llevamos un contador de los bytes que se leyeron
+  
+  while (leido < len) { //verifica que la cantidad de bytes leidos sea igual al tamaño pedido
+    int rc = read(c->fd, (char*)buf + leido, len - leido); //vamos leyendo de a poco
+    if (rc <= 0) return -1;
+    leido += rc; //aumentamos el contador de bytes leido
+  }
+  return 0;
+}
+
+//escribe len bytes en el canal.
+//retorna 0 si pudo escribirlos todos, -1 si no.
+int escribir_canal(Canal c, const void* buf, int len) {
+  
+  if (c->region != NULL)
+    return anillo_escribir(&c->region->respuestas, buf, len, &c->region->cerrado, c->fd);
+  
+  //si la conexion sigue claves, otro thread puede estar mandandole
+  //una invalidacion: que los mensajes no se mezclen
+  bloquear_escritura(c->fd);
+  int escrito = 0;
+  while (escrito < len) {
+    int rc = send(c->fd, (const char*)buf + escrito, len - escrito, MSG_NOSIGNAL); //sin SIGPIPE si el cliente cerro
+    if (rc <= 0) break;
+    escrito += rc;
+  }
+  desbloquear_escritura(c->fd);
+  return escrito < len ? -1 : 0;
+}
+
 //funcion de lectura utilizada para leer los bytes del tamaño de clave/valor.
-//lee los bytes del socket, y los transforma en un entero en formato little-endian.
-int readn(int fd) {
+//lee los bytes del canal, y los transforma en un entero en formato little-endian.
+int readn(Canal c) {
   
   uint32_t temp;
   int res = 0;
   
-  int rc = read(fd, &temp, sizeof(temp));
-  if (rc <= 0) {
+  if (leer_canal(c, &temp, sizeof(temp)) < 0) {
     perror("readn failed");
     return -1;  
     //retorna -1 si no lee correctamente
@@ -92,219 +216,950 @@ int readn(int fd) {
   if ((uint32_t)res > max_size) {
     printf("Error: El tamaño de la clave excede el límite permitido de 2^32 - 1 bytes\n");
     char comm = EBIG;
-    write(fd, &comm, 1);
+    escribir_canal(c, &comm, 1);
     return -1;
   }
   
   return res;
 }
 
-//funcion de lectura utilizada para leer la clave o el valor, segun corresponda.
-void readm(int fd, void* buf, int len) {
+//lee un entero de 8 bytes (big-endian) del canal.
+//retorna 0 si pudo, -1 si no.
+int leer_numero(Canal c, uint64_t* n) {
   
-  int leido = 0; //llevamos un contador de los bytes que se leyeron
-  
-  while (leido < len) { //verifica que la cantidad de bytes leidos sea igual al tamaño de la clave/valor
-    int rc = read(fd, (char*)buf + leido, len - leido); //vamos leyendo de a poco
-    if (rc <= 0) {
-      perror("readm failed");
-      return;
-    }
-    leido += rc; //aumentamos el contador de bytes leido
+  uint64_t temp;
+  if (leer_canal(c, &temp, sizeof(temp)) < 0) {
+    perror("leer_numero failed");
+    return -1;
   }
+  *n = be64toh(temp);
+  return 0;
 }
 
-
-//parser de pedidos
-//una vez obtenido el pedido del cliente, realiza la accion correspondiente en la tablahash
-void parserBin(int csock, int epfd, TablaHash *th, ListaLru* lru) {
+//lee el byte de comando.
+//en los sockets unix puede venir acompañado de un fd (SCM_RIGHTS),
+//que se guarda en *fdRecibido (-1 si no vino ninguno).
+//retorna lo mismo que read.
+int leer_comando(Canal c, char* comando, int* fdRecibido) {
   
-  char comando = 0;
+  *fdRecibido = -1;
   
-  // Leemos el comando del cliente
-  int rc = read(csock, &comando, 1);
+  if (c->region != NULL)
+    return leer_canal(c, comando, 1) < 0 ? 0 : 1;
+  
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {.iov_base = comando, .iov_len = 1};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+  
+  int rc = recvmsg(c->fd, &msg, 0);
+  
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (rc > 0 && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(fdRecibido, CMSG_DATA(cmsg), sizeof(int));
+  
+  return rc;
+}
 
-  if (rc == 0) {
-    printf("El cliente cerró la conexión\n");
-    close(csock);
-    return;
-  } else if (rc < 0) {
-    perror("Error leyendo el comando");
-    close(csock);
-    return;
-  } else if (rc != 1) {
-    fprintf(stderr, "Comando incompleto leído: %d bytes\n", rc);
-    close(csock);
+//responde con un codigo de un byte
+void responder(Canal c, char codigo) {
+  c->respuesta = codigo;
+  escribir_canal(c, &codigo, 1);
+}
+
+//responde OKE + longitud + datos en una unica escritura
+void responder_datos(Canal c, char* datos, int len) {
+  
+  char comm = OKE;
+  c->respuesta = OKE;
+  int len_net = htonl(len); //convertimos el valor a big-endian (para poder enviarlo por el socket)
+                           //htonl -> thread-safe
+  int bufLength = 1 + 4 + len;
+  char* buffer = reservar_temporal(bufLength);
+  if (buffer == NULL) {
+    responder(c, EUNK);
     return;
   }
+  //armamos una unica rta a enviar
+  // OK + len + datos
+  memcpy(buffer, &comm, sizeof(char));
+  memcpy(buffer+1, &len_net, 4);
+  memcpy(buffer+5, datos, len);
+  escribir_canal(c, buffer, bufLength);
+  liberar(buffer);
+}
 
-  if (comando == PUT) {  
+//particion a la que pertenece la clave.
+//mezclamos los bits del hash para no repartir con los mismos bits
+//que eligen la casilla de la tablahash
+Particion particion_de(char* clave) {
+  
+  if (nParticiones == 1) return particiones[0];
+  
+  unsigned h = funcion_hash(clave);
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return particiones[h % nParticiones];
+}
+
+//escribe en buf una linea con los contadores de un lock.
+//retorna la cantidad de bytes escritos
+int linea_perfil(char* buf, int tam, const char* nombre, PerfilLock* perfil) {
+  int n = snprintf(buf, tam, "%s ACQ=%lu CONT=%lu TRY_FAIL=%lu WAIT_US=%llu\n", nombre,
+                   __atomic_load_n(&perfil->adquisiciones, __ATOMIC_RELAXED),
+                   __atomic_load_n(&perfil->contendidas, __ATOMIC_RELAXED),
+                   __atomic_load_n(&perfil->fallidos, __ATOMIC_RELAXED),
+                   __atomic_load_n(&perfil->esperaNs, __ATOMIC_RELAXED) / 1000);
+  return n < 0 ? 0 : (n < tam ? n : tam - 1);
+}
+
+//reporte del perfil de los locks (LOCKSTATS): por cada particion los
+//contadores de la lru, de stats y la suma de sus secciones, y despues las
+//LOCKS_REPORTE secciones en las que mas se espero.
+//retorna la cantidad de bytes escritos en buf.
+int reporte_locks(char* buf, int tam) {
+  
+  int len = snprintf(buf, tam, "PROFILING=%s\n", perfil_locks_activo() ? "ON" : "OFF (usar -P)");
+  
+  //las secciones mas disputadas, ordenadas por espera
+  PerfilLock* top[LOCKS_REPORTE];
+  int topPart[LOCKS_REPORTE], topIdx[LOCKS_REPORTE];
+  int nTop = 0;
+  
+  for (int p = 0; p < nParticiones; p++) {
+    TablaHash th = particiones[p]->th;
+    char nombre[32];
     
-    int lenClave = readn(csock); //leemos la longitud de la clave
-    if (lenClave <= 0) {
-      perror("Error leyendo la longitud de la clave");
-      return;
-    }
-    unsigned char* clave = safe_malloc(sizeof(unsigned char), lenClave + 1, (*th), (*lru)); //reservamos memoria
-    readm(csock, clave, lenClave); //leemos la clave
-    clave[lenClave] = '\0'; 
+    snprintf(nombre, sizeof(nombre), "PART=%d LRU", p);
+    len += linea_perfil(buf + len, tam - len, nombre, &particiones[p]->lru->perfil);
+    snprintf(nombre, sizeof(nombre), "PART=%d STATS", p);
+    len += linea_perfil(buf + len, tam - len, nombre, &particiones[p]->st->perfil);
     
-    int lenValor = readn(csock);  //leemos la longitud del valor
-    if (lenValor <= 0) {
-      perror("Error leyendo la longitud del valor");
-      free(clave);
-      return;
+    PerfilLock suma;
+    iniciar_perfil(&suma);
+    for (int i = 0; i < LOCKS; i++) {
+      PerfilLock* perfil = &th->perfiles[i];
+      unsigned long long espera = __atomic_load_n(&perfil->esperaNs, __ATOMIC_RELAXED);
+      suma.adquisiciones += __atomic_load_n(&perfil->adquisiciones, __ATOMIC_RELAXED);
+      suma.contendidas += __atomic_load_n(&perfil->contendidas, __ATOMIC_RELAXED);
+      suma.fallidos += __atomic_load_n(&perfil->fallidos, __ATOMIC_RELAXED);
+      suma.esperaNs += espera;
+      
+      if (__atomic_load_n(&perfil->contendidas, __ATOMIC_RELAXED) == 0 &&
+          __atomic_load_n(&perfil->fallidos, __ATOMIC_RELAXED) == 0) continue;
+      
+      //insercion ordenada entre las LOCKS_REPORTE de mayor espera
+      int j = nTop < LOCKS_REPORTE ? nTop++ : LOCKS_REPORTE;
+      while (j > 0 && top[j-1]->esperaNs < espera) {
+        if (j < LOCKS_REPORTE) {
+          top[j] = top[j-1];
+          topPart[j] = topPart[j-1];
+          topIdx[j] = topIdx[j-1];
+        }
+        j--;
+      }
+      if (j < LOCKS_REPORTE) {
+        top[j] = perfil;
+        topPart[j] = p;
+        topIdx[j] = i;
+      }
+    }
+    snprintf(nombre, sizeof(nombre), "PART=%d STRIPES", p);
+    len += linea_perfil(buf + len, tam - len, nombre, &suma);
+  }
+  
+  for (int j = 0; j < nTop; j++) {
+    char nombre[32];
+    snprintf(nombre, sizeof(nombre), "PART=%d STRIPE=%d", topPart[j], topIdx[j]);
+    len += linea_perfil(buf + len, tam - len, nombre, top[j]);
+  }
+  
+  return len;
+}
+
+//pone en 0 los contadores de todos los locks perfilados (LOCKSTATS_RESET)
+void reiniciar_locks() {
+  for (int p = 0; p < nParticiones; p++) {
+    reiniciar_perfil(&particiones[p]->lru->perfil);
+    reiniciar_perfil(&particiones[p]->st->perfil);
+    for (int i = 0; i < LOCKS; i++) {
+      reiniciar_perfil(&particiones[p]->th->perfiles[i]);
+    }
+  }
+}
+
+//lee una longitud y luego esa cantidad de bytes, en un buffer
+//terminado en '\0'. retorna el buffer o NULL si no pudo leerlo
+char* leer_argumento(Canal c, int* len, TablaHash th, ListaLru lru) {
+  
+  *len = readn(c); //leemos la longitud
+  if (*len <= 0) {
+    perror("Error leyendo la longitud del argumento");
+    return NULL;
+  }
+  char* arg = safe_malloc(sizeof(char), *len + 1, th, lru); //reservamos memoria
+  if (leer_canal(c, arg, *len) < 0) { //leemos la clave/valor
+    perror("readm failed");
+    liberar(arg);
+    return NULL;
+  }
+  arg[*len] = '\0';
+  return arg;
+}
+
+//libera los argumentos del pedido
+void liberar_pedido(Pedido* p) {
+  liberar(p->clave); //liberamos memoria ya que en crear_comando se reserva nueva
+  liberar(p->valor);
+  p->clave = NULL;
+  p->valor = NULL;
+}
+
+//lee los argumentos que corresponden al comando del pedido.
+//retorna 0 si pudo, -1 si no.
+int leer_pedido(Canal c, Pedido* p, TablaHash th, ListaLru lru) {
+  
+  p->clave = NULL;
+  p->valor = NULL;
+  p->lenClave = 0;
+  p->lenValor = 0;
+  p->numero = 0;
+  
+  char com = p->comando;
+  
+  if (com == PUT || com == DEL || com == GET || com == GETS || com == CAS ||
+      com == INCR || com == DECR || com == APPEND || com == PREPEND) {
+    p->clave = leer_argumento(c, &p->lenClave, th, lru); //leemos la clave
+    if (p->clave == NULL) return -1;
+  }
+  if (com == PUT || com == CAS || com == APPEND || com == PREPEND) {
+    p->valor = leer_argumento(c, &p->lenValor, th, lru); //leemos el valor
+    if (p->valor == NULL) {
+      liberar_pedido(p);
+      return -1;
     }
-    unsigned char* valor = safe_malloc(sizeof(unsigned char), lenValor + 1, (*th), (*lru)); //reservamos memoria
-    readm(csock, valor, lenValor); //leemos el valor
-    valor[lenValor] = '\0';  
+  }
+  if (com == CAS || com == INCR || com == DECR) {
+    if (leer_numero(c, &p->numero) < 0) { //leemos la version o el delta
+      liberar_pedido(p);
+      return -1;
+    }
+  }
+  if (com == FLUSH_NS) {
+    //el nombre del espacio no es una clave (no se reenvia a ninguna particion)
+    p->valor = leer_argumento(c, &p->lenValor, th, lru);
+    if (p->valor == NULL) return -1;
+  }
+  return 0;
+}
+
+//guarda en la cache de la particion (arg) un valor leido del respaldo
+void guardar_leido(char* clave, char* valor, void* arg) {
+  Particion part = arg;
+  Comando com = crear_comando((unsigned char*)clave, (unsigned char*)valor, part->th, part->lru);
+  insertar_si_falta(part->th, com, part->lru, part->st, clave_limpia);
+}
+
+//ejecuta el pedido en la tablahash y responde por el canal
+void ejecutar_pedido(Canal c, Pedido* p, Particion part) {
+
+  TablaHash th = part->th;
+  ListaLru lru = part->lru;
+  Stats st = part->st;
+  
+  //con -B, si las escrituras pendientes del respaldo llenaron su tabla,
+  //los pedidos que escriben esperan a que se vacie o se descartan
+  int escribe = p->comando == PUT || p->comando == DEL || p->comando == CAS ||
+                p->comando == INCR || p->comando == DECR || p->comando == APPEND || p->comando == PREPEND;
+  if (escribe && hay_respaldo() && esperar_lugar_respaldo() != 0) {
+    responder(c, EOVERLOAD);
+    __atomic_add_fetch(&pedidosDescartados, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  if (p->comando == PUT) {  
     
-    Comando com = crear_comando(clave, valor, (*th), (*lru)); //creamos el comando que insertaremos en la th
-    free(clave); //liberamos memoria ya que en crear_comando se reserva nueva
-    free(valor); //liberamos memoria ya que en crear_comando se reserva nueva
+    Comando com = crear_comando((unsigned char*)p->clave, (unsigned char*)p->valor, th, lru); //creamos el comando que insertaremos en la th
     
     //insertamos en la tablahash
-    insertar_tabla((*th), com, (*lru), st);
+    insertar_tabla(th, com, lru, st);
     
     //tomamos el lock para modificar uno de los contadores de Stats
     //en este caso, incrementamos la cantidad de puts realizados
-    pthread_mutex_lock(&lockStats);
+    bloquear(&st->lock, &st->perfil);
     st->put += 1;
-    pthread_mutex_unlock(&lockStats);
+    pthread_mutex_unlock(&st->lock);
     
     //enviamos la respuesta la servidor una vez hecho su pedido
-    char comm = OK;
-    write(csock, &comm, 1);
+    responder(c, OK);
   
-  } else if (comando == DEL) { 
-    
-    int lenClave = readn(csock); //leemos la longitud de la clave
-    if (lenClave <= 0) {
-      perror("Error leyendo la longitud de la clave");
-      return;
-    }
-    char* clave = safe_malloc(sizeof(char), lenClave+1, (*th), (*lru)); //reservamos memoria
-    readm(csock, clave, lenClave); //leemos la clave
-    clave[lenClave] = '\0';
+  } else if (p->comando == DEL) { 
     
     //eliminamos el par {clave,valor} correspondiente 
     //a la clave ingresada como argumento
-    int c = eliminar_nodo_tabla((*th), clave, (*lru), 1);
-    free(clave); //una vez eliminado el comando, liberamos la clave
+    int r = eliminar_nodo_tabla(th, p->clave, lru, 1);
     
     //tomamos el lock para modificar uno de los contadores de Stats
     //en este caso, incrementamos la cantidad de dels realizados
-    pthread_mutex_lock(&lockStats);
+    bloquear(&st->lock, &st->perfil);
     st->del += 1;
-    pthread_mutex_unlock(&lockStats);
+    pthread_mutex_unlock(&st->lock);
 
-    if (c) { //verificamos si la clave fue encontrada o no
+    if (r) { //verificamos si la clave fue encontrada o no
 
       //tomamos el lock para modificar uno de los contadores de Stats
       //en este caso, decrementamos la cantidad de keys ya que 
       //eliminamos un par {clave,valor}
-      pthread_mutex_lock(&lockStats);
+      bloquear(&st->lock, &st->perfil);
       st->keys -= 1;
-      pthread_mutex_unlock(&lockStats);
+      pthread_mutex_unlock(&st->lock);
+    }
+    
+    if (r == 1) {
       
       //respondemos al cliente
-      char comm = OK;
-      write(csock, &comm, 1);
+      responder(c, OK);
 
     } else { //en caso de no encontrar el par a eliminar
+             //(o si estaba invalidado por un FLUSH)
 
       //respondemos al cliente
-      char comm = ENOTFOUND;
-      write(csock, &comm, 1);
+      responder(c, ENOTFOUND);
     }
   
-  } else if (comando == GET) { 
+  } else if (p->comando == GET) { 
     
-    int lenClave = readn(csock); //leemos la longitud de la clave
-    if (lenClave <= 0) {
-      perror("Error leyendo la longitud de la clave");
-      return;
-    }
-    char* clave = safe_malloc(sizeof(char), lenClave+1, (*th), (*lru)); //reservamos memoria
-    readm(csock, clave, lenClave); //leemos la clave
-    clave[lenClave] = '\0';
+    //si la conexion sigue claves, la anotamos antes de buscarla (ver seguimiento.h)
+    if (c->region == NULL && seguimiento_activo(c->fd)) seguir_clave(p->clave, c->fd);
     
     //buscamos en la tablahash el valor asociado a la clave que se pasa como argumento
-    char* v = buscar_tabla((*th), clave, (*lru));
-    free(clave); //una vez realizada la busqueda del comando, liberamos la clave
+    //(es una copia, la liberamos despues de responder)
+    char* v = buscar_tabla(th, p->clave, lru, NULL);
+    
+    //si no esta y hay respaldo (-B), la leemos de ahi (y queda en la cache)
+    char* leido = NULL;
+    if (v == NULL && hay_respaldo()) leido = leer_respaldo(p->clave, guardar_leido, part);
 
     //tomamos el lock para modificar uno de los contadores de Stats
     //en este caso, incrementamos la cantidad de gets realizados
-    pthread_mutex_lock(&lockStats);
+    bloquear(&st->lock, &st->perfil);
     st->get += 1;
-    pthread_mutex_unlock(&lockStats);
+    pthread_mutex_unlock(&st->lock);
     
-    if (v != NULL) { //si encontramos el valor
-
+    if (v != NULL || leido != NULL) { //si encontramos el valor
       //mandamos el valor solicitado al cliente
-      char comm = OKE;
-      int len = strlen(v);
-      int len_net = htonl(len); //convertimos el valor a big-endian (para poder enviarlo por el socket)
-                               //htonl -> thread-safe
-      int bufLength = 1 + 4 + len;
-      char buffer[bufLength];
-      //armamos una unica rta a enviar
-      // OK + lenValor + valor
-      memcpy(buffer, &comm, sizeof(char));
-      memcpy(buffer+1, &len_net, 4);
-      memcpy(buffer+5, v, len);
-      write(csock, buffer, bufLength);
-
+      char* valor = v != NULL ? v : leido;
+      responder_datos(c, valor, strlen(valor));
     } else { //en caso de no encontrar el par
-      
       //respondemos al cliente
-      char comm = ENOTFOUND;
-      write(csock, &comm, 1);
+      responder(c, ENOTFOUND);
+    }
+    liberar(v);
+    free(leido);
+  
+  } else if (p->comando == GETS) { //como GET, pero la respuesta empieza con
+                                  //la version del valor (8 bytes), para usar en CAS
+    
+    if (c->region == NULL && seguimiento_activo(c->fd)) seguir_clave(p->clave, c->fd);
+    
+    unsigned long long version;
+    char* v = buscar_tabla(th, p->clave, lru, &version);
+    
+    //la version la tiene el item de la cache: si vino del respaldo, la buscamos de nuevo
+    if (v == NULL && hay_respaldo()) {
+      free(leer_respaldo(p->clave, guardar_leido, part));
+      v = buscar_tabla(th, p->clave, lru, &version);
+    }
+    
+    bloquear(&st->lock, &st->perfil);
+    st->get += 1;
+    pthread_mutex_unlock(&st->lock);
+    
+    if (v != NULL) {
+      int len = strlen(v);
+      char* buffer = reservar_temporal(8 + len);
+      if (buffer == NULL) {
+        liberar(v);
+        responder(c, EUNK);
+        return;
+      }
+      uint64_t version_net = htobe64(version);
+      memcpy(buffer, &version_net, 8);
+      memcpy(buffer + 8, v, len);
+      liberar(v);
+      responder_datos(c, buffer, 8 + len);
+      liberar(buffer);
+    } else {
+      responder(c, ENOTFOUND);
+    }
+  
+  } else if (p->comando == CAS || p->comando == INCR || p->comando == DECR ||
+             p->comando == APPEND || p->comando == PREPEND) { //modificaciones atomicas,
+                                                             //se hacen con la seccion de la tablahash tomada
+    int r;
+    uint64_t resultado = 0;
+    
+    //si la clave no esta en la cache pero si en el respaldo (-B), la traemos
+    //(como en GETS) y la modificamos en un segundo intento
+    for (int intento = 0; intento < 2; intento++) {
+      if (p->comando == CAS) {
+        Comando com = crear_comando((unsigned char*)p->clave, (unsigned char*)p->valor, th, lru);
+        r = cas_tabla(th, com, p->numero, lru);
+      } else if (p->comando == INCR || p->comando == DECR) {
+        r = incr_tabla(th, p->clave, p->numero, p->comando == DECR, lru, &resultado);
+      } else {
+        r = concatenar_tabla(th, p->clave, p->valor, p->comando == APPEND, lru);
+      }
+      
+      if (r != OP_NOENCONTRADA || intento > 0 || !hay_respaldo()) break;
+      
+      char* leido = leer_respaldo(p->clave, guardar_leido, part);
+      if (leido == NULL) break;
+      free(leido);
     }
+    
+    //las contamos como puts
+    bloquear(&st->lock, &st->perfil);
+    st->put += 1;
+    pthread_mutex_unlock(&st->lock);
+    
+    if (r == OP_NOENCONTRADA) {
+      responder(c, ENOTFOUND);
+    } else if (r == OP_VERSION) {
+      responder(c, EVERSION);
+    } else if (r == OP_NONUMERICO) {
+      responder(c, ENONNUM);
+    } else if (p->comando == INCR || p->comando == DECR) { //respondemos el valor nuevo
+      char buffer[21];
+      int len = snprintf(buffer, sizeof(buffer), "%" PRIu64, resultado);
+      responder_datos(c, buffer, len);
+    } else {
+      responder(c, OK);
+    }
+  
+  } else if (p->comando == FLUSH_NS) { //invalida las claves "espacio:..." del espacio,
+                                      //sin recorrer la tablahash (ver espacios.h)
+    int rc = vaciar_espacio(p->valor);
+    if (rc == 0) { //el espacio no tiene items
+      responder(c, ENOTFOUND);
+    } else if (rc < 0) { //la tabla de espacios se lleno: puede tener items que no se invalidan
+      responder(c, EUNK);
+    } else {
+      invalidar_todo(); //los clientes que siguen claves descartan su cache
+      responder(c, OK);
+    }
+  
+  } else if (p->comando == FLUSH_ALL) { //invalida todas las claves
+    
+    vaciar_todo();
+    invalidar_todo();
+    responder(c, OK);
+  
+  } else if (p->comando == TRACK) { //la conexion empieza a seguir las claves que lee:
+                                   //se le avisa cuando cambian (INVALIDATE)
+    if (c->region == NULL && activar_seguimiento(c->fd) == 0) {
+      responder(c, OK);
+    } else { //los clientes locales no reciben avisos
+      responder(c, EINVALID);
+    }
+  
+  } else if (p->comando == LOCKSTATS) { //obtenemos cuanto se espero por cada lock
+                                       //y las secciones de la tablahash mas disputadas
+    char buffer[4096];
+    int len = reporte_locks(buffer, sizeof(buffer));
+    responder_datos(c, buffer, len);
   
-  } else if (comando == STATS) { //obtenemos la cantidad de veces que se realizó c/pedido
-                                //al igual que la cantidad de claves ingresadas
-    char buffer[128];
-    int len = snprintf(buffer, sizeof(buffer), "PUTS=%lld DELS=%lld GETS=%lld KEYS=%lld\n",
-                         st->put, st->del, st->get, st->keys);
+  } else if (p->comando == LOCKSTATS_RESET) { //reinicia los contadores de LOCKSTATS
+    
+    reiniciar_locks();
+    responder(c, OK);
+  
+  } else if (p->comando == LATENCY) { //percentiles de latencia de cada comando,
+                                     //separando aciertos de fallos
+    char buffer[8192];
+    int len = reporte_latencias(buffer, sizeof(buffer));
+    responder_datos(c, buffer, len);
+  
+  } else if (p->comando == LATENCY_RESET) { //reinicia los histogramas
+    
+    reiniciar_latencias();
+    responder(c, OK);
+  
+  } else if (p->comando == STATS) { //obtenemos la cantidad de veces que se realizó c/pedido
+                                   //al igual que la cantidad de claves ingresadas,
+                                   //sumando las de todas las particiones
+    long long int puts = 0, dels = 0, gets = 0, keys = 0;
+    for (int i = 0; i < nParticiones; i++) {
+      Stats s = particiones[i]->st;
+      bloquear(&s->lock, &s->perfil);
+      puts += s->put;
+      dels += s->del;
+      gets += s->get;
+      keys += s->keys;
+      pthread_mutex_unlock(&s->lock);
+    }
+    //y los contadores de sobrecarga y del respaldo.
+    //un FLUSH no recorre la tabla, los items invalidados siguen contando en
+    //KEYS hasta que se borran: lo aclaramos en el reporte
+    char buffer[768];
+    int len = snprintf(buffer, sizeof(buffer), "PUTS=%lld DELS=%lld GETS=%lld KEYS=%lld CONNS=%lld REJECTED_CONNS=%lld SHED=%lld\n"
+                         "(KEYS incluye las claves invalidadas por FLUSH_NS/FLUSH_ALL que todavia no se borraron)\n",
+                         puts, dels, gets, keys,
+                         __atomic_load_n(&conexiones, __ATOMIC_RELAXED),
+                         __atomic_load_n(&conexionesRechazadas, __ATOMIC_RELAXED),
+                         __atomic_load_n(&pedidosDescartados, __ATOMIC_RELAXED));
     if (len < 0) {
       perror("Error formateando la cadena");
+      responder(c, EUNK);
       return;
     }
-    
-    char comm = OKE;
-    int len_net = htonl(len); //convertimos el valor a big-endian (para poder enviarlo por el socket)
-                             //htonl -> thread-safe
-    int bufLength = 1 + 4 + len;
-    char buff[bufLength];
-    //armamos una unica rta a enviar
-    // OK + lenStats + stats
-    memcpy(buff, &comm, sizeof(char));
-    memcpy(buff+1, &len_net, 4);
-    memcpy(buff+5, buffer, len);
-    write(csock, buff, bufLength);
+    if (hay_respaldo()) len += reporte_respaldo(buffer + len, sizeof(buffer) - len);
+    responder_datos(c, buffer, len);
+  
+  } else if (p->comando == HOTKEYS) { //obtenemos las claves mas accedidas, con su tasa
+                                     //estimada y el stripe de locks que las protege
+                                     //(con -S, el reporte de cada particion)
+    char buffer[NTHREADS * HOT_TOPK * (HOT_MAX_CLAVE + 64)];
+    int len = 0;
+    for (int i = 0; i < nParticiones; i++) {
+      len += reporte_hot(particiones[i]->th->hot, buffer + len, sizeof(buffer) - len);
+    }
+    responder_datos(c, buffer, len);
   
   } else { //el comando ingresado por el cliente no es válido
     
-    char buffer[1024];
-    read(csock, buffer, sizeof(buffer)); //leemos basura restante en el socket
+    //descartamos la basura restante en el canal
+    if (c->region != NULL) {
+      anillo_descartar(&c->region->pedidos);
+    } else {
+      char buffer[1024];
+      recv(c->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    }
 
     //respondemos al cliente
-    char comm = EINVALID;
-    write(csock, &comm, 1);
+    responder(c, EINVALID);
   }
+}
+
+//cierra una conexion de un cliente
+void cerrar_conexion(int fd) {
+  cerrar_seguimiento(fd);
+  close(fd);
+  __atomic_sub_fetch(&conexiones, 1, __ATOMIC_RELAXED);
+}
+
+//si el pedido espero mas que esperaMaxNs desde que el worker tomo la
+//conexion (no desde que llego al socket), lo descarta respondiendo
+//EOVERLOAD: el cliente probablemente ya no espera la respuesta y ejecutarlo
+//solo atrasaria a los pedidos que vienen detras.
+//retorna 1 si se descarto.
+int descartar_vencido(Canal c, Pedido* p, unsigned long long ahora) {
   
-  //rearmamos el socket
-  //necesario debido a EPOLLONESHOT
+  if (esperaMaxNs == 0 || ahora - p->llegada <= esperaMaxNs) return 0;
+  
+  responder(c, EOVERLOAD);
+  __atomic_add_fetch(&pedidosDescartados, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+//atiende los pedidos de un cliente local por la region compartida,
+//hasta que este cierra la conexion
+void* atender_anillo(void* args) {
+  
+  AnilloArgs a = (AnilloArgs)args;
+  struct _canal c = {.fd = a->sock, .region = a->region};
+  
+  while (atender_pedido(&c, NULL) >= 0) {
+    enviar_avisos(); //invalidaciones que encolo el pedido (TRACK)
+  }
+  enviar_avisos();
+  
+  //si el cliente sigue esperando una respuesta, que vea el cierre
+  __atomic_store_n(&a->region->cerrado, 1, __ATOMIC_RELEASE);
+  anillo_despertar(&a->region->respuestas);
+  anillo_despertar(&a->region->pedidos);
+  
+  munmap(a->region, sizeof(RegionCompartida));
+  cerrar_conexion(a->sock);
+  __atomic_sub_fetch(&anillos, 1, __ATOMIC_RELAXED);
+  free(a);
+  return NULL;
+}
+
+//pasa la conexion de un cliente local a memoria compartida.
+//mapea la region que mando el cliente y lanza un thread que la atiende.
+//la region tiene que tener el tamaño justo y estar sellada (F_SEAL_SHRINK y
+//F_SEAL_GROW): si el cliente pudiera achicarla, el acceso a lo que quedo
+//fuera mataria al servidor con SIGBUS.
+//si ya hay MAX_ANILLOS conexiones responde EOVERLOAD.
+//retorna 0 si pudo, -1 si no.
+int iniciar_anillo(Canal c, int fdRegion) {
+  
+  struct stat st;
+  int sellos = fcntl(fdRegion, F_GET_SEALS);
+  if (fstat(fdRegion, &st) != 0 || st.st_size != sizeof(RegionCompartida) ||
+      sellos < 0 || (sellos & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW)) {
+    fprintf(stderr, "Region compartida invalida (tamaño o sellos), se rechaza\n");
+    close(fdRegion);
+    responder(c, EINVALID);
+    return -1;
+  }
+  
+  if (__atomic_add_fetch(&anillos, 1, __ATOMIC_RELAXED) > MAX_ANILLOS) {
+    __atomic_sub_fetch(&anillos, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&conexionesRechazadas, 1, __ATOMIC_RELAXED);
+    close(fdRegion);
+    responder(c, EOVERLOAD);
+    return -1;
+  }
+  
+  RegionCompartida* region = mmap(NULL, sizeof(RegionCompartida), PROT_READ | PROT_WRITE, MAP_SHARED, fdRegion, 0);
+  close(fdRegion);
+  if (region == MAP_FAILED) {
+    perror("mmap de la region compartida");
+    __atomic_sub_fetch(&anillos, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  
+  AnilloArgs a = malloc(sizeof(struct _anilloArgs));
+  a->sock = c->fd;
+  a->region = region;
+  
+  //respondemos por el socket antes de que el cliente empiece a usar la region
+  responder(c, OK);
+  
+  pthread_t hilo;
+  if (pthread_create(&hilo, NULL, atender_anillo, (void*)a) != 0) {
+    perror("pthread_create");
+    munmap(region, sizeof(RegionCompartida));
+    free(a);
+    __atomic_sub_fetch(&anillos, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  pthread_detach(hilo);
+  return 0;
+}
+
+//rearma la conexion en la instancia epoll
+//necesario debido a EPOLLONESHOT
+void rearmar(int fd, int epfd) {
   struct epoll_event event;
   event.events = EPOLLIN | EPOLLONESHOT;
-  event.data.fd = csock;
-  if (epoll_ctl(epfd, EPOLL_CTL_MOD, csock, &event) == -1) {
+  event.data.fd = fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event) == -1) {
     perror("epoll_ctl: conn_sock");
     exit(EXIT_FAILURE);
   }
 }
 
+//despierta al dueño de la particion para que atienda sus reenvios
+void avisar_particion(Particion destino) {
+  uint64_t uno = 1;
+  if (write(destino->aviso, &uno, sizeof(uno)) < 0)
+    perror("write eventfd");
+}
+
+//pasa el pedido al dueño de la particion destino, que lo ejecuta,
+//responde y rearma la conexion. mientras tanto la conexion no se rearma,
+//asi los pedidos de un mismo cliente se siguen respondiendo en orden.
+//si la cola del dueño esta llena, el pedido queda retenido en el worker
+//(y la conexion sin leer) hasta que haya lugar: ver reintentar_reenvios.
+//retorna 0, o -1 si no hay memoria.
+int reenviar(Particion destino, Wfc w, int fd, Pedido* p) {
+  
+  Reenvio r = reservar_temporal(sizeof(struct _reenvio));
+  if (r == NULL) return -1;
+  r->p = *p;
+  r->fd = fd;
+  r->epfd = w->epfd;
+  r->destino = destino;
+  r->canal = NULL;
+  r->fin = NULL;
+  r->sig = NULL;
+  
+  if (w->retenidos == NULL && encolar(&destino->entrada[w->id], r) == 0) {
+    avisar_particion(destino);
+    return 0;
+  }
+  
+  if (w->retenidos == NULL) {
+    w->retenidos = r;
+  } else {
+    w->ultimoRetenido->sig = r;
+  }
+  w->ultimoRetenido = r;
+  return 0;
+}
+
+//vuelve a encolar los pedidos retenidos del worker, en orden,
+//hasta que alguna cola siga llena
+void reintentar_reenvios(Wfc w) {
+  
+  while (w->retenidos != NULL) {
+    Reenvio r = w->retenidos;
+    if (encolar(&r->destino->entrada[w->id], r) < 0) return;
+    w->retenidos = r->sig;
+    r->sig = NULL;
+    avisar_particion(r->destino);
+  }
+}
+
+//pasa el pedido de un thread de memoria compartida al dueño de la particion
+//destino y espera a que lo ejecute y responda por el canal
+void reenviar_anillo(Particion destino, Canal c, Pedido* p) {
+  
+  Fin fin = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .listo = 0};
+  struct _reenvio r = {.p = *p, .fd = c->fd, .epfd = -1, .destino = destino, .canal = c, .fin = &fin};
+  
+  pthread_mutex_lock(&destino->lockAnillos);
+  r.sig = destino->entradaAnillos;
+  destino->entradaAnillos = &r;
+  pthread_mutex_unlock(&destino->lockAnillos);
+  avisar_particion(destino);
+  
+  pthread_mutex_lock(&fin.lock);
+  while (!fin.listo) pthread_cond_wait(&fin.cond, &fin.lock);
+  pthread_mutex_unlock(&fin.lock);
+  
+  pthread_mutex_destroy(&fin.lock);
+  pthread_cond_destroy(&fin.cond);
+}
+
+//ejecuta un pedido reenviado y lo libera
+void ejecutar_reenvio(Reenvio r, Particion part) {
+  
+  struct _canal socket = {.fd = r->fd, .region = NULL};
+  Canal c = r->canal != NULL ? r->canal : &socket;
+  
+  if (!descartar_vencido(c, &r->p, reloj_ns())) { //el tiempo en la cola tambien cuenta como espera
+    ejecutar_pedido(c, &r->p, part);
+    enviar_avisos(); //invalidaciones que encolo el pedido (TRACK)
+    registrar_latencia(r->p.comando, c->respuesta == OK || c->respuesta == OKE, r->p.inicio);
+  }
+  liberar_pedido(&r->p);
+  
+  if (r->fin != NULL) { //el thread de memoria compartida sigue con su proximo pedido
+    pthread_mutex_lock(&r->fin->lock);
+    r->fin->listo = 1;
+    pthread_cond_signal(&r->fin->cond);
+    pthread_mutex_unlock(&r->fin->lock);
+    return;
+  }
+  rearmar(r->fd, r->epfd);
+  liberar(r);
+}
+
+//ejecuta los pedidos que los otros workers le pasaron a la particion
+void atender_reenvios(Particion part) {
+  
+  //vaciamos el eventfd antes que las colas, asi un aviso posterior no se pierde
+  uint64_t avisos;
+  if (read(part->aviso, &avisos, sizeof(avisos)) < 0 && errno != EAGAIN)
+    perror("read eventfd");
+  
+  for (int i = 0; i < NTHREADS; i++) {
+    Reenvio r;
+    while ((r = desencolar(&part->entrada[i])) != NULL) {
+      ejecutar_reenvio(r, part);
+    }
+  }
+  
+  pthread_mutex_lock(&part->lockAnillos);
+  Reenvio r = part->entradaAnillos;
+  part->entradaAnillos = NULL;
+  pthread_mutex_unlock(&part->lockAnillos);
+  
+  while (r != NULL) {
+    Reenvio sig = r->sig; //r es del thread de memoria compartida, deja de valer al ejecutarlo
+    ejecutar_reenvio(r, part);
+    r = sig;
+  }
+}
+
+//atiende un pedido del canal.
+//w es el worker que lo atiende (NULL en los threads de memoria compartida).
+//retorna 0 si se atendio, -1 si el canal se cerro o hubo un error,
+//1 si la conexion paso a memoria compartida (la atiende otro thread)
+//y 2 si el pedido se reenvio al dueño de su particion.
+int atender_pedido(Canal c, Wfc w) {
+  
+  Particion propia = particiones[w != NULL ? w->id % nParticiones : 0];
+  Pedido p;
+  int fdRecibido;
+  
+  // Leemos el comando del cliente
+  int rc = leer_comando(c, &p.comando, &fdRecibido);
+
+  if (rc == 0) {
+    printf("El cliente cerró la conexión\n");
+    return -1;
+  } else if (rc < 0) {
+    perror("Error leyendo el comando");
+    return -1;
+  } else if (rc != 1) {
+    fprintf(stderr, "Comando incompleto leído: %d bytes\n", rc);
+    return -1;
+  }
+  
+  if (p.comando == SHM && fdRecibido >= 0 && c->region == NULL) { //cliente local
+    return iniciar_anillo(c, fdRecibido) == 0 ? 1 : -1;
+  }
+  if (fdRecibido >= 0) close(fdRecibido); //no esperabamos un fd
+  
+  unsigned long long antes = reloj_ns();
+  if (leer_pedido(c, &p, propia->th, propia->lru) < 0) return -1;
+  p.inicio = reloj_ns(); //la latencia se mide desde aca hasta que se escribe la respuesta
+  
+  //la espera se cuenta desde que epoll_wait le entrego la conexion al worker:
+  //el tiempo que el pedido paso en el buffer del socket antes no se ve.
+  //no contamos lo que tardaron en llegar las claves y valores (de este pedido
+  //y de los anteriores): una subida lenta no es una espera en el servidor
+  if (w != NULL) w->leyendo += p.inicio - antes;
+  p.llegada = w != NULL ? w->despertar + w->leyendo : p.inicio;
+  if (descartar_vencido(c, &p, p.inicio)) {
+    liberar_pedido(&p);
+    return 0;
+  }
+  
+  //si la clave es de otra particion se la pasamos a su dueño: solo el
+  //dueño toca su particion. los threads de memoria compartida no tienen
+  //particion, le pasan al dueño todos los pedidos con clave
+  Particion destino = p.clave != NULL ? particion_de(p.clave) : propia;
+  if (particionado && w == NULL && p.clave != NULL) {
+    reenviar_anillo(destino, c, &p);
+    return 0;
+  }
+  if (destino != propia) {
+    if (reenviar(destino, w, c->fd, &p) == 0) return 2;
+    responder(c, EOVERLOAD); //sin memoria para el reenvio
+    __atomic_add_fetch(&pedidosDescartados, 1, __ATOMIC_RELAXED);
+    liberar_pedido(&p);
+    return 0;
+  }
+  
+  ejecutar_pedido(c, &p, destino);
+  registrar_latencia(p.comando, c->respuesta == OK || c->respuesta == OKE, p.inicio);
+  liberar_pedido(&p);
+  
+  return 0;
+}
+
+//retorna 1 si hay bytes sin leer en el socket
+int datos_pendientes(int sock) {
+  int n = 0;
+  return ioctl(sock, FIONREAD, &n) == 0 && n > 0;
+}
+
+//parser de pedidos
+//una vez obtenido el pedido del cliente, realiza la accion correspondiente en la tablahash.
+//si el cliente mando varios pedidos seguidos, atiende hasta profundidad
+//antes de rearmar el socket, asi una conexion no acapara al worker.
+void parserBin(int csock, Wfc w) {
+  
+  struct _canal c = {.fd = csock, .region = NULL};
+  
+  for (int i = 0; i < profundidad; i++) {
+    
+    int rc = atender_pedido(&c, w);
+    enviar_avisos(); //los desalojos al leer el pedido tambien invalidan (TRACK)
+    
+    if (rc < 0) {
+      cerrar_conexion(csock);
+      return;
+    }
+    if (rc > 0) return; //la conexion ahora la atiende atender_anillo, o el dueño de la particion
+    
+    if (!datos_pendientes(csock)) break;
+  }
+  
+  //rearmamos el socket
+  rearmar(csock, w->epfd);
+}
+
+//sin fds disponibles: libera el fd de reserva para sacar la conexion
+//de la cola de listen y la rechaza con EOVERLOAD.
+//si no se pudo, espera un poco antes de que epoll vuelva a avisar
+void rechazar_sin_fds(int sock) {
+  
+  pthread_mutex_lock(&lockReserva);
+  int rechazada = 0;
+  if (fdReserva >= 0) {
+    close(fdReserva);
+    int conn_sock = accept(sock, NULL, NULL);
+    if (conn_sock >= 0) {
+      char comm = EOVERLOAD;
+      if (send(conn_sock, &comm, 1, MSG_NOSIGNAL) < 0) perror("write");
+      close(conn_sock);
+      __atomic_add_fetch(&conexionesRechazadas, 1, __ATOMIC_RELAXED);
+      rechazada = 1;
+    }
+    fdReserva = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+  pthread_mutex_unlock(&lockReserva);
+  
+  if (!rechazada) {
+    perror("accept"); //la conexion sigue en la cola de listen
+    usleep(ESPERA_ACEPTAR_MS * 1000);
+  }
+}
+
+//acepta una conexion en el socket de escucha sock (tcp o unix)
+//y la agrega a la instancia epoll
+void aceptar(int sock, int epfd) {
+  
+  int conn_sock = accept(sock, NULL, NULL); //acepta la conexion con el socket
+  if (conn_sock == -1) {
+    if (particionado && (errno == EAGAIN || errno == EWOULDBLOCK)) return; //la acepto otro worker
+    if (errno != EMFILE && errno != ENFILE && errno != ECONNABORTED) {
+      perror("accept");
+      exit(EXIT_FAILURE);
+    }
+    if (errno != ECONNABORTED) rechazar_sin_fds(sock);
+    conn_sock = -1;
+  }
+  
+  if (conn_sock >= 0 && __atomic_add_fetch(&conexiones, 1, __ATOMIC_RELAXED) > maxConexiones) {
+    //demasiadas conexiones: avisamos y cerramos
+    char comm = EOVERLOAD;
+    if (send(conn_sock, &comm, 1, MSG_NOSIGNAL) < 0) perror("write");
+    cerrar_conexion(conn_sock);
+    __atomic_add_fetch(&conexionesRechazadas, 1, __ATOMIC_RELAXED);
+    conn_sock = -1;
+  }
+  
+  if (conn_sock >= 0) {
+    //agregamos la nueva conexion a la instancia epoll
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = conn_sock;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn_sock, &event) == -1) {
+      perror("epoll_ctl: conn_sock");
+      exit(EXIT_FAILURE);
+    }
+  }
+  
+  if (particionado) return; //el socket de escucha no es EPOLLONESHOT
+  
+  //rearmamos el socket de escucha
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.fd = sock;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, sock, &event) == -1) {
+    perror("epoll_ctl: lsock");
+    exit(EXIT_FAILURE);
+  }
+}
+
+//fija el thread actual a un procesador
+void fijar_procesador(int id) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (rc != 0)
+    fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(rc));
+}
+
 //espera la llegada de clientes estableciendo
 //conexiones con esto para que manden sus pedidos.
 //estos pedidos son manejados con parserBin
@@ -312,50 +1167,37 @@ void *wait_for_clients(void* args) {
 
   //guardamos los argumentos recibidos
   Wfc w = (Wfc)args;
-  TablaHash *th = w->th;
-  ListaLru *lru = w->lru;
   int lsock = w->lsock;
+  int usock = w->usock;
+  Particion propia = particiones[w->id % nParticiones];
+  
+  if (particionado) fijar_procesador(w->id);
   
   struct epoll_event events[MAX_EVENTS];
-  int nfds, conn_sock;
+  int nfds;
   
   for (;;) { //bucle infinito para la espera de clientes
     printf("Esperando eventos\n");
-    nfds = epoll_wait(epfd, events, MAX_EVENTS, -1); //en events se guardan los fd que posean eventos disponibles (ready list)
+    //con pedidos retenidos volvemos cada ESPERA_RETENIDOS_MS a intentar pasarlos
+    int espera = w->retenidos != NULL ? ESPERA_RETENIDOS_MS : -1;
+    nfds = epoll_wait(w->epfd, events, MAX_EVENTS, espera); //en events se guardan los fd que posean eventos disponibles (ready list)
                                                     //y retorna la cantidad de estos
     if (nfds == -1) { 
       perror("epoll_wait");
       exit(EXIT_FAILURE);
     }
+    w->despertar = reloj_ns();
+    w->leyendo = 0;
+    reintentar_reenvios(w);
     
     for (int n = 0; n < nfds; ++n) {
-      if (events[n].data.fd == lsock) { //si hay un evento,
-        conn_sock = accept(lsock, NULL, NULL); //acepta la conexion con el socket
-        if (conn_sock == -1) {
-          perror("accept");
-          exit(EXIT_FAILURE);
-        }
-        
-        //agregamos la nueva conexion a la instancia epoll
-        struct epoll_event event;
-        event.events = EPOLLIN | EPOLLONESHOT;
-        event.data.fd = conn_sock;
-        if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn_sock, &event) == -1) {
-          perror("epoll_ctl: conn_sock");
-          exit(EXIT_FAILURE);
-        }
-        
-        //rearmamos el socket de escucha
-        event.events = EPOLLIN | EPOLLONESHOT;
-        event.data.fd = lsock;
-        if (epoll_ctl(epfd, EPOLL_CTL_MOD, lsock, &event) == -1) {
-          perror("epoll_ctl: lsock");
-          exit(EXIT_FAILURE);
-        }
-          
+      if (events[n].data.fd == lsock || events[n].data.fd == usock) { //si hay un evento,
+        aceptar(events[n].data.fd, w->epfd);
+      } else if (particionado && events[n].data.fd == propia->aviso) { //pedidos de otros workers
+        atender_reenvios(propia);
       } else {
         //una vez establecida la conexion, se manejan los pedidos
-        parserBin(events[n].data.fd, epfd, th, lru);
+        parserBin(events[n].data.fd, w);
       }
     }
   }
@@ -451,9 +1293,53 @@ int mk_lsock() {
 	return lsock;
 }
 
+//crea un socket de escucha unix en la ruta dada,
+//para los clientes que corren en el mismo host
+int mk_usock(char* ruta) {
+	struct sockaddr_un sa;
+	int usock;
+
+	usock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (usock < 0)
+		quit("socket unix");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, ruta, sizeof(sa.sun_path) - 1);
+	
+	unlink(ruta); //borramos el socket de una ejecucion anterior
+	if (bind(usock, (struct sockaddr *)&sa, sizeof sa) < 0)
+		quit("bind unix");
+
+	if (listen(usock, 10) < 0)
+		quit("listen unix");
+
+	return usock;
+}
+
+//agrega un socket de escucha a la interest list de la instancia epoll.
+//con -S esta en la de todos los workers: EPOLLEXCLUSIVE despierta a uno solo
+void escuchar(int sock, int epfd) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event)); //inicializamos la estructura con ceros, para evitar que haya basura
+	ev.events = particionado ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN | EPOLLONESHOT; //indica que el fd esta disponible para leer
+	ev.data.fd = sock; //agg socket de escucha a la estructura
+	
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) == -1) { //se agrega el socket a la interest list
+		perror("epoll_ctl: lsock");
+		exit(EXIT_FAILURE);
+	}
+}
+
 //Chatgpt
 //configura el limite de memoria
 void limitar_memoria(size_t max_memoria_mb) {
+#ifdef __SANITIZE_THREAD__
+  //ThreadSanitizer reserva terabytes de espacio de direcciones (make tsan):
+  //queda solo el limite de los items (configurar_memoria)
+  (void)max_memoria_mb;
+  return;
+#endif
   struct rlimit limite;
   limite.rlim_cur = max_memoria_mb * 1024 * 1024;  // Soft limit
   limite.rlim_max = max_memoria_mb * 1024 * 1024;  // Hard limit  
@@ -463,59 +1349,193 @@ void limitar_memoria(size_t max_memoria_mb) {
   }
 }
 
-int main() {
+//crea una particion con su tablahash, lru, stats e instancia epoll
+Particion crear_particion() {
+  
+  Particion part = malloc(sizeof(struct _particion));
+  part->st = crear_stats();
+  part->th = crear_tabla(TH, (FuncionHash) funcion_hash, (FuncionComparadora) compCom, (FuncionDestructora) destrCom, largoClave);
+  part->lru = crear_lru();
+  for (int i = 0; i < NTHREADS; i++) {
+    crear_cola(&part->entrada[i]);
+  }
+  part->entradaAnillos = NULL;
+  pthread_mutex_init(&part->lockAnillos, NULL);
+  
+  if ((part->epfd = epoll_create1(0)) == -1) { //creamos la instancia epoll
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  
+  part->aviso = -1;
+  if (particionado) { //el dueño se entera de los reenvios por su instancia epoll
+    if ((part->aviso = eventfd(0, EFD_NONBLOCK)) == -1) {
+      perror("eventfd");
+      exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN;
+    ev.data.fd = part->aviso;
+    if (epoll_ctl(part->epfd, EPOLL_CTL_ADD, part->aviso, &ev) == -1) {
+      perror("epoll_ctl: eventfd");
+      exit(EXIT_FAILURE);
+    }
+  }
+  
+  return part;
+}
+
+//muestra las opciones del servidor
+void uso(char* prog) {
+  fprintf(stderr, "Uso: %s [-m MB] [-H] [-u ruta] [-S] [-P] [-c conexiones] [-p pedidos] [-d ms] [-B dir] [-k 8|16]\n", prog);
+  fprintf(stderr, "  -m MB    presupuesto de memoria (por defecto %d). incluye la memoria libre que guardan\n", MEMORIA_MB);
+  fprintf(stderr, "           las caches de los threads; cada thread actualiza el contador de a %dKB,\n", UMBRAL_CONTADOR / 1024);
+  fprintf(stderr, "           asi que el uso puede pasarse hasta %dKB por thread\n", UMBRAL_CONTADOR / 1024);
+  fprintf(stderr, "  -H       reservar la memoria de los items al inicio, en huge pages de 2MB\n");
+  fprintf(stderr, "  -u ruta  escuchar tambien en un socket unix (clientes locales, ver cliente_local.h)\n");
+  fprintf(stderr, "  -S       particionar las claves: cada worker, fijado a un procesador, es dueño de una particion.\n");
+  fprintf(stderr, "           no es libre de locks: siguen los locks por franja y el de cada lru, que el dueño\n");
+  fprintf(stderr, "           comparte con el recolector global y el mantenimiento de la particion\n");
+  fprintf(stderr, "  -P       perfilar los locks (ver LOCKSTATS)\n");
+  fprintf(stderr, "  -c N     maximo de conexiones abiertas, las demas se rechazan con EOVERLOAD (por defecto %d)\n", MAX_CONEXIONES);
+  fprintf(stderr, "  -p N     pedidos seguidos de una conexion por cada evento (por defecto %d)\n", PROFUNDIDAD);
+  fprintf(stderr, "  -d ms    descartar con EOVERLOAD los pedidos que esperaron mas (por defecto %d, 0 = nunca).\n", ESPERA_MAX_MS);
+  fprintf(stderr, "           la espera se mide desde que un worker tomo la conexion, sin el tiempo en el socket\n");
+  fprintf(stderr, "  -B dir   respaldar las claves en archivos del directorio: lectura a traves y escritura diferida\n");
+  fprintf(stderr, "  -k N     las claves suelen tener N bytes (8 o 16): se comparan con cargas de 8 bytes\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
 	
-	//establece el limite de memoria
-  limitar_memoria(2000);  //limitar a 2GB
-
-  //inicializamos los mutex de la tablahash recursivos
-	pthread_mutexattr_init(&recHash);
-	pthread_mutexattr_settype(&recHash, PTHREAD_MUTEX_RECURSIVE_NP);
-	for (int i = 0; i < LOCKS; i++) {
-		pthread_mutex_init(&locks[i], &recHash);
+  size_t memoria = MEMORIA_MB;
+  int usarPool = 0;
+  char* rutaUnix = NULL;
+  char* rutaRespaldo = NULL;
+  
+  //leemos las opciones
+  int opt;
+  while ((opt = getopt(argc, argv, "m:Hu:SPc:p:d:B:k:")) != -1) {
+    switch (opt) {
+      case 'm':
+        memoria = atol(optarg);
+        if (memoria == 0) uso(argv[0]);
+        break;
+      case 'H':
+        usarPool = 1;
+        break;
+      case 'u':
+        rutaUnix = optarg;
+        break;
+      case 'S':
+        particionado = 1;
+        break;
+      case 'P':
+        activar_perfil_locks();
+        break;
+      case 'c':
+        maxConexiones = atoi(optarg);
+        if (maxConexiones <= 0) uso(argv[0]);
+        break;
+      case 'p':
+        profundidad = atoi(optarg);
+        if (profundidad <= 0) uso(argv[0]);
+        break;
+      case 'd':
+        esperaMaxNs = atol(optarg) * 1000000ULL;
+        break;
+      case 'B':
+        rutaRespaldo = optarg;
+        break;
+      case 'k':
+        largoClave = atoi(optarg);
+        if (largoClave != 8 && largoClave != 16) uso(argv[0]);
+        break;
+      default:
+        uso(argv[0]);
+    }
+  }
+  
+  if (usarPool) {
+    //reservamos todo el presupuesto de una vez, los items se cortan de ahi
+    if (crear_pool(memoria * 1024 * 1024, 1) != 0) {
+      fprintf(stderr, "Error: No se pudo reservar el pool de memoria\n");
+      exit(EXIT_FAILURE);
+    }
+    limitar_memoria(memoria + MARGEN_POOL_MB);
+  } else {
+	  //establece el limite de memoria
+    limitar_memoria(memoria);
+  }
+
+  //creamos las particiones (los mutex de cada una los inicializan
+  //crear_tabla, crear_lru y crear_stats)
+	nParticiones = particionado ? NTHREADS : 1;
+	for (int i = 0; i < nParticiones; i++) {
+		particiones[i] = crear_particion();
 	}
+	iniciar_seguimiento(); //tabla de claves seguidas (TRACK)
 	
-  //inicializamos el mutex de la lru recursivo
-	pthread_mutexattr_init(&recLru);
-	pthread_mutexattr_settype(&recLru, PTHREAD_MUTEX_RECURSIVE_NP);
-	pthread_mutex_init(&lockLru, &recLru);
-
-  //inicializamos el mutex de stats
-	pthread_mutex_init(&lockStats, 0);
+	if (rutaRespaldo != NULL && iniciar_respaldo(&respaldoArchivos, rutaRespaldo) != 0) {
+		fprintf(stderr, "Error: No se pudo abrir el respaldo en %s\n", rutaRespaldo);
+		exit(EXIT_FAILURE);
+	}
 
+	fdReserva = open("/dev/null", O_RDONLY | O_CLOEXEC); //para rechazar conexiones sin fds libres
+	
 	int lsock;
 	lsock = mk_lsock(); //socket de escucha
 	
-	if ((epfd = epoll_create1(0)) == -1) { //creamos la instancia epoll
-		perror("epoll_create1");
-		exit(EXIT_FAILURE);
+	int usock = -1;
+	if (rutaUnix != NULL) { //socket unix para clientes locales
+		usock = mk_usock(rutaUnix);
 	}
-
-	struct epoll_event ev;
-	memset(&ev, 0, sizeof(struct epoll_event)); //inicializamos la estructura con ceros, para evitar que haya basura
-	ev.events = EPOLLIN | EPOLLONESHOT; //indica que el fd esta disponible para leer
-	ev.data.fd = lsock; //agg socket de escucha a la estructura
 	
-	if (epoll_ctl(epfd, EPOLL_CTL_ADD, lsock, &ev) == -1) { //se agrega el socket a la interest list
-		perror("epoll_ctl: lsock");
-		exit(EXIT_FAILURE);
-	}	
-
-  //creamos las estructuras
-	st = crear_stats();
-	TablaHash th = crear_tabla(TH, (FuncionHash) funcion_hash, (FuncionComparadora) compCom, (FuncionDestructora) destrCom);
-	ListaLru lru = crear_lru();
-
-  //guardamos las estructuras + el socket de escucha 
-  //en una estructura para pasarlo a wait_for_clients
-	Wfc w = safe_malloc(sizeof(struct _wfc),1,th,lru);
-	w->lsock = lsock;
-	w->th = &th;
-	w->lru = &lru;
+	//con -S los sockets de escucha estan en todas las instancias epoll:
+	//los hacemos no bloqueantes por si dos workers intentan aceptar la misma conexion
+	if (particionado) {
+		fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK);
+		if (usock >= 0) fcntl(usock, F_SETFL, fcntl(usock, F_GETFL) | O_NONBLOCK);
+	}
+	
+	for (int i = 0; i < nParticiones; i++) {
+		escuchar(lsock, particiones[i]->epfd);
+		if (usock >= 0) escuchar(usock, particiones[i]->epfd);
+	}
 	
-  //creamos los threads y llamamos a wait_for_clients
+  //creamos los threads que mantienen los segmentos de cada lru
+	for (int i = 0; i < nParticiones; i++) {
+		pthread_t mantenedor;
+		pthread_create(&mantenedor, NULL, mantenedor_lru, (void*)particiones[i]->lru);
+	}
+
+  //creamos el thread recolector, que desaloja en segundo plano para mantener
+  //la memoria de los items por debajo de las marcas.
+  //sin pool, el resto del limite queda para la tablahash, stacks, etc.
+	configurar_memoria(usarPool ? memoria * 1024 * 1024 : memoria * 1024 * 1024 / 100 * PORC_ITEMS);
+	RecolectorArgs r = malloc(sizeof(struct _recolectorArgs));
+	r->cantidad = nParticiones;
+	r->tablas = malloc(sizeof(TablaHash) * nParticiones);
+	r->lrus = malloc(sizeof(ListaLru) * nParticiones);
+	for (int i = 0; i < nParticiones; i++) {
+		r->tablas[i] = particiones[i]->th;
+		r->lrus[i] = particiones[i]->lru;
+	}
+	pthread_t recolectorHilo;
+	pthread_create(&recolectorHilo, NULL, recolector, (void*)r);
+
+  //creamos los threads y llamamos a wait_for_clients.
+  //cada uno recibe los sockets de escucha y la instancia epoll de su particion
 	pthread_t threads[NTHREADS];
 	for (unsigned i = 0; i < NTHREADS; i++) {
+		Wfc w = malloc(sizeof(struct _wfc));
+		w->lsock = lsock;
+		w->usock = usock;
+		w->id = i;
+		w->epfd = particiones[i % nParticiones]->epfd;
+		w->retenidos = NULL;
+		w->ultimoRetenido = NULL;
 	 	pthread_create(&(threads[i]), NULL, wait_for_clients, (void*)w);
   }
 
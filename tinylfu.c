@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "tinylfu.h"
+
+//semillas (impares) para obtener un indice distinto por fila
+static const unsigned semillas[SKETCH_FILAS] = {0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu};
+
+//indice de la fila i para el hash dado
+static unsigned indice_fila(unsigned hash, int i) {
+  unsigned x = hash * semillas[i];
+  x ^= x >> 15;
+  return x & (SKETCH_ANCHO - 1);
+}
+
+//crea el sketch con todos los contadores en cero
+Sketch crear_sketch() {
+  Sketch sk = malloc(sizeof(struct _sketch));
+  memset(sk->contadores, 0, sizeof(sk->contadores));
+  sk->muestras = 0;
+  pthread_mutex_init(&sk->lockEnvejecer, 0);
+  return sk;
+}
+
+//divide a la mitad todos los contadores, para que las frecuencias
+//viejas pierdan peso frente a las recientes.
+//los incrementos concurrentes pueden perderse, lo cual es tolerable
+//ya que el sketch es de por si una estimacion.
+static void envejecer(Sketch sk) {
+  if (pthread_mutex_trylock(&sk->lockEnvejecer) != 0) return; //otro thread ya lo esta haciendo
+  for (int i = 0; i < SKETCH_FILAS; i++) {
+    for (int j = 0; j < SKETCH_ANCHO; j++) {
+      unsigned char c = __atomic_load_n(&sk->contadores[i][j], __ATOMIC_RELAXED);
+      __atomic_store_n(&sk->contadores[i][j], c >> 1, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&sk->lockEnvejecer);
+}
+
+//registra un acceso (GET o PUT) a la clave con el hash dado.
+//no toma locks: los contadores se modifican con operaciones atomicas relajadas.
+void registrar_acceso(Sketch sk, unsigned hash) {
+  for (int i = 0; i < SKETCH_FILAS; i++) {
+    unsigned char* c = &sk->contadores[i][indice_fila(hash, i)];
+    if (__atomic_load_n(c, __ATOMIC_RELAXED) < SKETCH_MAX)
+      __atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+  }
+
+  //cada SKETCH_PERIODO accesos envejecemos el sketch
+  if (__atomic_add_fetch(&sk->muestras, 1, __ATOMIC_RELAXED) >= SKETCH_PERIODO) {
+    __atomic_store_n(&sk->muestras, 0, __ATOMIC_RELAXED);
+    envejecer(sk);
+  }
+}
+
+//estima la frecuencia de acceso de la clave con el hash dado
+//(minimo entre los contadores de cada fila)
+unsigned estimar_frecuencia(Sketch sk, unsigned hash) {
+  unsigned min = SKETCH_MAX;
+  for (int i = 0; i < SKETCH_FILAS; i++) {
+    unsigned c = __atomic_load_n(&sk->contadores[i][indice_fila(hash, i)], __ATOMIC_RELAXED);
+    if (c < min) min = c;
+  }
+  return min;
+}
+
+//libera el sketch
+void destruir_sketch(Sketch sk) {
+  pthread_mutex_destroy(&sk->lockEnvejecer);
+  free(sk);
+}
@@ -0,0 +1,29 @@
+#ifndef __TINYLFU_H__
+#define __TINYLFU_H__
+#include <pthread.h>
+
+//dimensiones del sketch (count-min)
+#define SKETCH_FILAS 4
+#define SKETCH_ANCHO (1 << 17) //potencia de 2
+#define SKETCH_MAX 15 //los contadores saturan en 15 (como en TinyLFU)
+#define SKETCH_PERIODO (10 * SKETCH_ANCHO) //incrementos entre cada envejecimiento
+
+//estructura del sketch de frecuencias
+//cada fila usa una funcion de indice distinta y
+//la estimacion es el minimo entre las filas
+typedef struct _sketch {
+  unsigned char contadores[SKETCH_FILAS][SKETCH_ANCHO];
+  unsigned long muestras; //incrementos desde el ultimo envejecimiento
+  pthread_mutex_t lockEnvejecer;
+} *Sketch;
+
+//FUNCIONES SKETCH
+Sketch crear_sketch();
+
+void registrar_acceso(Sketch sk, unsigned hash);
+
+unsigned estimar_frecuencia(Sketch sk, unsigned hash);
+
+void destruir_sketch(Sketch sk);
+
+#endif